@@ -8,6 +8,9 @@
    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
    See the License for the specific language governing permissions and
    limitations under the License. */
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE // pthread_setaffinity_np()
+#endif
 #include <stdint.h>
 #include <stdbool.h>
 #include <stdio.h>
@@ -29,6 +32,7 @@
     #pragma warning(disable: 4996) // posix names
 #else
     #include <unistd.h>
+    #include <fcntl.h>
     #include <sys/mman.h>
     #include <pthread.h>
 #endif
@@ -121,12 +125,46 @@ void mem_unmap(void* address, int bytes) {
     }
 }
 
+void* mem_map_create(const char* filename, int bytes) { // new or truncated file of `bytes`
+    void* address = null;
+    errno = 0;
+    DWORD access = GENERIC_READ | GENERIC_WRITE;
+    HANDLE file = CreateFileA(filename, access, FILE_SHARE_READ, null, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, null);
+    if (file == INVALID_HANDLE_VALUE) {
+        errno = GetLastError();
+    } else {
+        HANDLE map_file = CreateFileMappingA(file, NULL, PAGE_READWRITE, 0, (DWORD)bytes, null); // extends the file
+        if (map_file == null) {
+            errno = GetLastError();
+        } else {
+            address = MapViewOfFile(map_file, FILE_MAP_WRITE, 0, 0, bytes);
+            if (address == null) { errno = GetLastError(); }
+            int b = CloseHandle(map_file);
+            assert(b); (void)b;
+        }
+        int b = CloseHandle(file);
+        assert(b); (void)b;
+    }
+    return address;
+}
+
+int file_resize(const char* filename, int bytes) { // returns 0 or error
+    HANDLE file = CreateFileA(filename, GENERIC_WRITE, FILE_SHARE_READ, null, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, null);
+    if (file == INVALID_HANDLE_VALUE) { return GetLastError(); }
+    LARGE_INTEGER size = {{0, 0}};
+    size.QuadPart = bytes;
+    int r = SetFilePointerEx(file, size, null, FILE_BEGIN) && SetEndOfFile(file) ? 0 : GetLastError();
+    int b = CloseHandle(file);
+    assert(b); (void)b;
+    return r;
+}
+
 #else
 
 static double time_in_seconds() {
     enum { BILLION = 1000000000 };
     struct timespec ts;
-    clock_gettime(CLOCK_REALTIME, &ts);
+    clock_gettime(CLOCK_MONOTONIC, &ts); // not affected by NTP adjustments
     uint64_t ns = ts.tv_sec * (uint64_t)BILLION + ts.tv_nsec;
     static uint64_t ns0;
     if (ns0 == 0) { ns0 = ns; }
@@ -148,47 +186,487 @@ static void mem_free(void* a, int bytes) {
     }
 }
 
+static void* mem_map(const char* filename, int* bytes, bool read_only) {
+    void* address = null;
+    *bytes = 0; // important for empty files - which result in (null, 0) and errno == 0
+    errno = 0;
+    int fd = open(filename, read_only ? O_RDONLY : O_RDWR);
+    if (fd >= 0) {
+        struct stat st;
+        if (fstat(fd, &st) != 0) {
+            // errno is set by fstat()
+        } else if (st.st_size > 0x7FFFFFFF) {
+            errno = EFBIG;
+        } else if (st.st_size > 0) {
+            const int prot = read_only ? PROT_READ : PROT_READ|PROT_WRITE;
+            address = mmap(null, (size_t)st.st_size, prot, MAP_SHARED, fd, 0);
+            if (address != MAP_FAILED) { *bytes = (int)st.st_size; } else { address = null; }
+        }
+        const int e = errno;
+        close(fd); // mapping keeps the file open
+        errno = e;
+    }
+    return address;
+}
+
+static void mem_unmap(void* address, int bytes) {
+    if (address != null) { munmap(address, bytes); }
+}
+
+static void* mem_map_create(const char* filename, int bytes) { // new or truncated file of `bytes`
+    void* address = null;
+    errno = 0;
+    int fd = open(filename, O_RDWR|O_CREAT|O_TRUNC, 0644);
+    if (fd >= 0) {
+        if (ftruncate(fd, bytes) == 0) {
+            address = mmap(null, bytes, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+            if (address == MAP_FAILED) { address = null; }
+        }
+        const int e = errno;
+        close(fd);
+        errno = e;
+    }
+    return address;
+}
+
+static int file_resize(const char* filename, int bytes) { // returns 0 or errno
+    return truncate(filename, bytes) == 0 ? 0 : errno;
+}
+
+#endif
+
+#if defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+    #define cycles() __rdtsc() // time stamp counter ticks
+#elif defined(__x86_64__) || defined(__i386__)
+    #include <x86intrin.h>
+    #define cycles() __rdtsc()
+#else
+    #define cycles() 0ULL // not available
+#endif
+
+#ifdef WIN32
+    #define atomic_fetch_increment(p) (InterlockedIncrement((volatile long*)(p)) - 1)
+#else
+    #define atomic_fetch_increment(p) __atomic_fetch_add(p, 1, __ATOMIC_RELAXED)
+#endif
+
+#ifdef _MSC_VER // stdio lock of the stream, held across several calls
+    #define file_lock(f)   _lock_file(f)
+    #define file_unlock(f) _unlock_file(f)
+#else
+    #define file_lock(f)   flockfile(f)
+    #define file_unlock(f) funlockfile(f)
 #endif
 
+static struct {
+    int    jobs;    // -j N threads compressing files of folders
+    bool   bench;   // -b repeat every codec call and report percentiles
+    int    runs;    // -n N at least N timed runs per codec call in bench mode
+    double seconds; // -t S and at least S seconds of them
+    bool   synthetic; // -s compress built-in synthetic images
+    int    format;    // -f text|csv|json of per image results
+    bool   encode;    // -e input output: file to stream
+    bool   decode;    // -d input output: stream to raw file
+    int    raw_w;     // -r WxH[xC] of raw input, 0 for PGM
+    int    raw_h;
+    int    raw_c;
+    bool   checksum;  // -k encode CRC32C of the samples into the stream
+    int    effort;    // -a N bdgr_encode_tuned() effort, 0 - format as is
+    bool   pipeline;  // -p folder output: read, encode and write files on separate threads
+} options = { 1, false, 31, 0.25, false, 0, false, false, 0, 0, 1, false, 0, false };
+
+enum { format_text, format_csv, format_json };
+
+static FILE* summary(void) { // keeps stdout of csv and json formats parseable
+    return options.format == format_text ? stdout : stderr;
+}
+
+enum { bench_warm_up = 3 }; // untimed runs: caches, branch predictors, clock
+
+typedef struct timing_s { // of a codec call in seconds
+    double min;
+    double median;
+    double p99;
+    double cycles; // median of cycles() ticks per call
+} timing_t;
+
+typedef int (*codec_fn_t)(void* context);
+
+static int compare_doubles(const void* a, const void* b) {
+    const double x = *(const double*)a;
+    const double y = *(const double*)b;
+    return x < y ? -1 : x > y;
+}
+
+static double percentile(const double* sorted, int n, double p) {
+    return sorted[(int)(p * (n - 1) + 0.5)];
+}
+
+// measure() times single call or in bench mode options.runs or more calls
+// after warm up. Returns result of the (last) call.
+
+static int measure(codec_fn_t codec, void* context, timing_t* t) {
+    memset(t, 0, sizeof(*t));
+    if (!options.bench) {
+        const double time = time_in_seconds();
+        const int r = codec(context);
+        t->min = t->median = t->p99 = time_in_seconds() - time;
+        return r;
+    }
+    int r = 0;
+    for (int i = 0; i < bench_warm_up; i++) { r = codec(context); }
+    int n = 0;
+    int capacity = 0;
+    double* seconds = null;
+    double* ticks = null;
+    double total = 0;
+    while (n < options.runs || total < options.seconds) {
+        if (n == capacity) {
+            capacity = capacity * 2 + 64;
+            seconds = (double*)realloc(seconds, capacity * sizeof(double));
+            ticks   = (double*)realloc(ticks,   capacity * sizeof(double));
+            if (seconds == null || ticks == null) { perror("out of memory"); exit(1); }
+        }
+        const uint64_t c = cycles();
+        const double time = time_in_seconds();
+        r = codec(context);
+        seconds[n] = time_in_seconds() - time;
+        ticks[n] = (double)(cycles() - c);
+        total += seconds[n];
+        n++;
+    }
+    qsort(seconds, n, sizeof(double), compare_doubles);
+    qsort(ticks, n, sizeof(double), compare_doubles);
+    t->min    = seconds[0];
+    t->median = percentile(seconds, n, 0.50);
+    t->p99    = percentile(seconds, n, 0.99);
+    t->cycles = percentile(ticks, n, 0.50);
+    free(seconds);
+    free(ticks);
+    return r;
+}
+
+typedef struct codec_s { // arguments of encode() and decode()
+    const bdgr_format_t* f;
+    const byte* input;
+    int         bytes; // of input stream for decode()
+    byte*       output;
+    int         max_bytes;
+    bdgr_context_t* context; // of bdgr_encode_tuned() with -a
+} codec_t;
+
+static int encode(void* context) {
+    const codec_t* c = (const codec_t*)context;
+    if (options.effort > 0) {
+        const int stride = c->f->w * c->f->channels * (c->f->depth > 8 ? 2 : 1);
+        return bdgr_encode_tuned(c->context, c->input, stride, c->f, options.effort,
+                                 c->output, c->max_bytes, null);
+    } else if (c->f->channels == 1 && c->f->depth <= 8 && !c->f->checksum) {
+        return bdgr_encode(c->input, c->f->w, c->f->h, c->output, c->max_bytes);
+    } else {
+        const int stride = c->f->w * c->f->channels * (c->f->depth > 8 ? 2 : 1);
+        return bdgr_encode_interleaved(c->input, stride, c->f, c->output, c->max_bytes);
+    }
+}
+
+static int decode(void* context) {
+    const codec_t* c = (const codec_t*)context;
+    return bdgr_decode(c->input, c->bytes, c->output, c->f->w, c->f->h);
+}
+
 // stats:
 
-static double percentage_sum;
-static double encode_time_sum;
-static double decode_time_sum;
-static int    run_count;
+static double  percentage_sum;
+static double  encode_time_sum;
+static double  decode_time_sum;
+static int64_t bytes_sum; // of decoded images
+static int     run_count;
 
-static void image_compress(const char* fn) {
-    if (access(fn, 0) != 0) {
-        fprintf(stderr, "file not found %s", fn);
-        exit(1);
+enum { crop_side = 64 }; // of the center crop decoded with bdgr_decode_region_ex()
+
+typedef struct worker_s { // buffers and stats of a thread
+    byte*   encoded;
+    byte*   decoded;
+    byte*   copy;      // of samples converted to host byte order
+    byte*   crop;      // crop_side^2 pixels of up to 4 channels of 16 bits
+    int     max_bytes; // allocated for encoded
+    int     bytes;     // allocated for decoded and copy
+    bdgr_context_t context; // scratch of bdgr_*_ex() calls
+    double  percentage_sum;
+    double  encode_time_sum;
+    double  decode_time_sum;
+    int64_t bytes_sum;
+    int     run_count;
+} worker_t;
+
+static void* context_allocate(void* that, size_t bytes) { // locked and pre-faulted
+    (void)that;
+    return bytes <= 0x7FFFFFFF ? mem_alloc((int)bytes) : null;
+}
+
+static void context_release(void* that, void* memory, size_t bytes) {
+    (void)that;
+    mem_free(memory, (int)bytes);
+}
+
+static void worker_reserve(worker_t* w, int max_bytes, int bytes) { // buffers are reused
+    if (w->crop == null) {
+        const bdgr_allocator_t allocator = { context_allocate, context_release, null };
+        bdgr_context_init(&w->context, &allocator);
+        w->crop = (byte*)mem_alloc(crop_side * crop_side * 4 * 2);
+    }
+    if (max_bytes > w->max_bytes) {
+        mem_free(w->encoded, w->max_bytes);
+        w->encoded = (byte*)mem_alloc(max_bytes);
+        w->max_bytes = max_bytes;
+    }
+    if (bytes > w->bytes) {
+        mem_free(w->decoded, w->bytes);
+        mem_free(w->copy, w->bytes);
+        w->decoded = (byte*)mem_alloc(bytes);
+        w->copy    = (byte*)mem_alloc(bytes);
+        w->bytes = bytes;
+    }
+}
+
+static void worker_done(worker_t* w) { // merges stats and frees buffers
+    percentage_sum  += w->percentage_sum;
+    encode_time_sum += w->encode_time_sum;
+    decode_time_sum += w->decode_time_sum;
+    bytes_sum       += w->bytes_sum;
+    run_count       += w->run_count;
+    mem_free(w->copy, w->bytes);
+    mem_free(w->decoded, w->bytes);
+    mem_free(w->encoded, w->max_bytes);
+    if (w->crop != null) {
+        mem_free(w->crop, crop_side * crop_side * 4 * 2);
+        bdgr_context_done(&w->context);
+    }
+    memset(w, 0, sizeof(*w));
+}
+
+// PNM: binary PGM (P5) and PPM (P6) with maxval up to 65535. Samples of
+// more than 8 bits are big endian in the file and are byte swapped, 8 bit
+// samples are coded straight from (and decoded straight into) mapped file.
+
+typedef struct pnm_s {
+    int w;
+    int h;
+    int c;      // 1 for PGM, 3 for PPM
+    int maxval;
+    int depth;  // bits per sample
+    int offset; // of the samples in the file
+} pnm_t;
+
+static bool is_pnm(const char* fn) {
+    const char* p = strrchr(fn, '.');
+    return p != null && (strcmp(p, ".pgm") == 0 || strcmp(p, ".ppm") == 0 || strcmp(p, ".pnm") == 0);
+}
+
+// pnm_parse() reads the header and checks that samples are in the first `bytes`
+
+static bool pnm_parse(const byte* s, int bytes, pnm_t* m) {
+    int v[3] = {0}; // width, height, maxval
+    int i = 2;
+    if (bytes < 2 || s[0] != 'P' || (s[1] != '5' && s[1] != '6')) { return false; }
+    for (int k = 0; k < 3; k++) {
+        while (i < bytes && (s[i] == '#' || s[i] == ' ' || (s[i] >= '\t' && s[i] <= '\r'))) {
+            if (s[i] == '#') { while (i < bytes && s[i] != '\n') { i++; } } else { i++; }
+        }
+        if (i == bytes || s[i] < '0' || s[i] > '9') { return false; }
+        while (i < bytes && '0' <= s[i] && s[i] <= '9' && v[k] <= 0xFFFFFFF) { v[k] = v[k] * 10 + s[i++] - '0'; }
+    }
+    if (i == bytes || v[0] == 0 || v[1] == 0 || v[2] == 0 || v[2] > 0xFFFF) { return false; }
+    m->w = v[0];
+    m->h = v[1];
+    m->c = s[1] == '5' ? 1 : 3;
+    m->maxval = v[2];
+    m->depth = 8;
+    while ((1 << m->depth) <= m->maxval) { m->depth++; }
+    m->offset = i + 1; // single whitespace after maxval
+    return (int64_t)m->w * m->h * m->c * (m->depth > 8 ? 2 : 1) <= bytes - m->offset;
+}
+
+// pnm_header() formats the header padded with spaces to 16 bytes boundary
+// (keeps 16 bit samples aligned) and returns its length
+
+static int pnm_header(char* text, const pnm_t* m) {
+    char tail[16];
+    const int k = sprintf(tail, "\n%d\n", m->maxval);
+    int n = sprintf(text, "P%c\n%d %d", m->c == 1 ? '5' : '6', m->w, m->h);
+    const int pad = (16 - (n + k) % 16) % 16; // whitespace between tokens
+    n += sprintf(text + n, "%*s%s", pad, "", tail);
+    return n;
+}
+
+// swap16() copies `bytes` of 16 bit samples swapping byte order, returns
+// false if any of them exceeds maxval
+
+static bool swap16(byte* d, const byte* s, int bytes, int maxval) {
+    int max = 0;
+    for (int i = 0; i < bytes; i += 2) {
+        const int v = s[i] << 8 | s[i + 1];
+        d[i] = (byte)v;
+        d[i + 1] = (byte)(v >> 8);
+        max = v > max ? v : max;
+    }
+    return max <= maxval;
+}
+
+// pnm_write() writes host order samples into mapped file, returns 0 or errno
+
+static int pnm_write(const char* filename, const pnm_t* m, const byte* samples) {
+    char header[64];
+    const int k = pnm_header(header, m);
+    const int bytes = m->w * m->h * m->c * (m->depth > 8 ? 2 : 1);
+    byte* d = (byte*)mem_map_create(filename, k + bytes);
+    if (d == null) { return errno; }
+    memcpy(d, header, k);
+    if (m->depth > 8) { swap16(d + k, samples, bytes, 0xFFFF); } else { memcpy(d + k, samples, bytes); }
+    mem_unmap(d, k + bytes);
+    return 0;
+}
+
+static const char* class_of_files = "file"; // of images loaded from files
+
+#ifdef BDGR_STATS
+
+// print_stats() runs codec once more (untimed) and prints hot path counters
+
+static void print_stats(const char* what, int (*codec)(void* context), void* context) {
+    bdgr_stats_t* s = bdgr_thread_stats();
+    memset(s, 0, sizeof(*s));
+    codec(context);
+    const double codes = s->codes > 0 ? (double)s->codes : 1;
+    printf("  %s codes %lld escapes %lld (%.3f%c) unary %.2f bits/code runs %lld of %lld pixels"
+           " tail refills %lld stored stripes %lld\n    bits:", what, (long long)s->codes,
+           (long long)s->escapes, s->escapes * 100 / codes, '%', s->unary / codes,
+           (long long)s->runs, (long long)s->run_pixels, (long long)s->tails, (long long)s->stored);
+    for (int i = 0; i < (int)countof(s->histogram); i++) {
+        if (s->histogram[i] > 0) { printf(" %d:%.1f%c", i, s->histogram[i] * 100 / codes, '%'); }
     }
-    int w = 0;
-    int h = 0;
-    int c = 0;
-    byte* data = stbi_load(fn, &w, &h, &c, 0);
-    assert(c == 1);
-    int bytes = w * h;
-    byte* encoded = (byte*)mem_alloc(bytes * 4);
-    byte* decoded = (byte*)mem_alloc(bytes);
-    byte* copy    = (byte*)mem_alloc(bytes);
-    memcpy(copy, data, bytes);
-    double encode_time = time_in_seconds();
-    int k = bdgr_encode(copy, w, h, encoded, bytes * 4);
-    encode_time = time_in_seconds() - encode_time;
-    double decode_time = time_in_seconds();
-    int n = bdgr_decode(encoded, k, decoded, w, h);
-    decode_time = time_in_seconds() - decode_time;
+    printf("\n");
+}
+
+#endif
+
+static int volatile records; // reported in csv or json format, separates json records
+
+// left_format() is format of w x h x c samples with left predictor and all
+// other fields zero (valid C and C++ without partial initializer lists)
+
+static bdgr_format_t left_format(int w, int h, int c, int depth) {
+    bdgr_format_t f;
+    memset(&f, 0, sizeof(f));
+    f.w = w;
+    f.h = h;
+    f.predictor = bdgr_predictor_left;
+    f.channels = c;
+    f.depth = depth;
+    return f;
+}
+
+// compress() round trips w x h x c samples of depth bits through encoder and
+// decoder, leaves decoded pixels in worker->decoded, reports and accumulates stats
+
+static void compress(const char* name, const char* class_name, const byte* data,
+                     int w, int h, int c, int depth, worker_t* worker) {
+    const int bytes = w * h * c * (depth > 8 ? 2 : 1);
+    bdgr_format_t f = left_format(w, h, c, depth);
+    f.transform = c >= 3 ? bdgr_transform_rct : 0;
+    const int max_bytes = bdgr_max_bytes(&f);
+    worker_reserve(worker, max_bytes, bytes);
+    byte* encoded = worker->encoded;
+    byte* decoded = worker->decoded;
+    timing_t te;
+    codec_t ce = { &f, data, 0, encoded, max_bytes, &worker->context };
+    const int k = measure(encode, &ce, &te);
+    assert(k > 0);
+    timing_t td;
+    codec_t cd = { &f, encoded, k, decoded, bytes, null };
+    const int n = measure(decode, &cd, &td);
     assert(n == bytes); (void)n;
-    assert(memcmp(decoded, data, n) == 0);
-    if (memcmp(decoded, data, n) != 0) {
-        fprintf(stderr, "decoded != original\n");
+    const double encode_time = te.median;
+    const double decode_time = td.median;
+    if (k <= 0 || n != bytes || memcmp(decoded, data, bytes) != 0) {
+        fprintf(stderr, "%s: decoded != original\n", name);
+        exit(1);
+    }
+    // center crop through reused context scratch: no allocations after the first image
+    const int pixel = c * (depth > 8 ? 2 : 1);
+    const int cw = w < crop_side ? w : crop_side;
+    const int ch = h < crop_side ? h : crop_side;
+    const int x = (w - cw) / 2;
+    const int y = (h - ch) / 2;
+    bool same = bdgr_decode_region_ex(&worker->context, encoded, k, worker->crop, cw * pixel,
+                                      x, y, cw, ch) == cw * ch * pixel;
+    for (int j = 0; j < ch && same; j++) {
+        same = memcmp(worker->crop + j * cw * pixel, data + ((size_t)(y + j) * w + x) * pixel,
+                      cw * pixel) == 0;
+    }
+    if (!same) {
+        fprintf(stderr, "%s: decoded region != original\n", name);
+        exit(1);
+    }
+    const int wh = bytes;
+    const double bpp = k * 8 / ((double)w * h * c);
+    const double percent = 100.0 * k / wh;
+    const double mb = bytes / (1024.0 * 1024.0);
+    const double pixels = (double)w * h;
+    if (options.format == format_csv) {
+        printf("%s,%s,%d,%d,%d,%d,%d,%.4f,%.2f,"
+               "%.4f,%.4f,%.4f,%.1f,%.2f,%.4f,%.4f,%.4f,%.1f,%.2f\n",
+               name, class_name, w, h, c, bytes, k, bpp, percent,
+               te.min * 1000, te.median * 1000, te.p99 * 1000, mb / te.median, te.cycles / pixels,
+               td.min * 1000, td.median * 1000, td.p99 * 1000, mb / td.median, td.cycles / pixels);
+        atomic_fetch_increment(&records);
+    } else if (options.format == format_json) {
+        file_lock(stdout); // first record printed is the one without separator
+        const char* separator = atomic_fetch_increment(&records) > 0 ? "," : "";
+        printf("%s{\"name\":\"%s\",\"class\":\"%s\",\"w\":%d,\"h\":%d,\"channels\":%d,"
+               "\"bytes\":%d,\"encoded\":%d,\"bpp\":%.4f,\"percent\":%.2f,\n"
+               "  \"encode\":{\"min_ms\":%.4f,\"median_ms\":%.4f,\"p99_ms\":%.4f,\"mb_per_s\":%.1f,\"cycles_per_pixel\":%.2f},\n"
+               "  \"decode\":{\"min_ms\":%.4f,\"median_ms\":%.4f,\"p99_ms\":%.4f,\"mb_per_s\":%.1f,\"cycles_per_pixel\":%.2f}}\n",
+               separator, name, class_name, w, h, c, bytes, k, bpp, percent,
+               te.min * 1000, te.median * 1000, te.p99 * 1000, mb / te.median, te.cycles / pixels,
+               td.min * 1000, td.median * 1000, td.p99 * 1000, mb / td.median, td.cycles / pixels);
+        file_unlock(stdout);
+    } else if (options.bench) {
+        printf("%-24s %dx%d %.3f bpp\n"
+               "  encode min %.4fms median %.4fms p99 %.4fms %.1fMB/s %.2f cycles/pixel\n"
+               "  decode min %.4fms median %.4fms p99 %.4fms %.1fMB/s %.2f cycles/pixel\n",
+               name, w, h, bpp,
+               te.min * 1000, te.median * 1000, te.p99 * 1000, mb / te.median, te.cycles / pixels,
+               td.min * 1000, td.median * 1000, td.p99 * 1000, mb / td.median, td.cycles / pixels);
+        #ifdef BDGR_STATS
+            print_stats("encode", encode, &ce);
+            print_stats("decode", decode, &cd);
+        #endif
+    } else {
+        printf("%-24s %dx%d %6d->%-6d bytes %.3f bpp %.1f%c encode %.4fs decode %.4fs\n",
+               name, w, h, wh, k, bpp, percent, '%', encode_time, decode_time);
+    }
+    worker->percentage_sum  += percent;
+    worker->encode_time_sum += encode_time;
+    worker->decode_time_sum += decode_time;
+    worker->bytes_sum       += bytes;
+    worker->run_count++;
+}
+
+// image_compress() maps PGM and PPM files and codes samples straight from
+// the mapping, other formats are loaded by stb_image
+
+static void image_compress(const char* fn, worker_t* worker) {
+    if (access(fn, 0) != 0) {
+        fprintf(stderr, "file not found %s", fn);
         exit(1);
     }
-    // write resulting image into out/*.png file
+    const bool pnm = is_pnm(fn);
+    // write resulting image into out/*.png (out/*.pgm or *.ppm for PNM) file
     char filename[128];
     const char* p = strrchr(fn, '.');
     int len = (int)(p - fn);
-    sprintf(filename, "%.*s.png", len, fn);
+    sprintf(filename, "%.*s.%s", len, fn, pnm ? p + 1 : "png");
     const char* file = strrchr(filename, '/');
     if (file == null) { file = filename; } else { file++; }
     char out[128];
@@ -198,82 +676,796 @@ static void image_compress(const char* fn) {
     #else
         mkdir("out");
     #endif
-    stbi_write_png(out, w, h, 1, decoded, 0);
-    const int wh = w * h;
-    const double bpp = k * 8 / (double)wh;
-    const double percent = 100.0 * k / wh;
-    printf("%-24s %dx%d %6d->%-6d bytes %.3f bpp %.1f%c encode %.4fs decode %.4fs\n",
-           file, w, h, wh, k, bpp, percent, '%', encode_time, decode_time);
-    percentage_sum  += percent;
-    encode_time_sum += encode_time;
-    decode_time_sum += decode_time;
-    run_count++;
-    mem_free(copy, bytes);
-    mem_free(decoded, bytes);
-    mem_free(encoded, bytes * 4);
-    stbi_image_free(data);
+    if (pnm) {
+        int bytes = 0;
+        byte* s = (byte*)mem_map(fn, &bytes, true);
+        pnm_t m;
+        if (s == null || !pnm_parse(s, bytes, &m)) {
+            fprintf(stderr, "failed to read %s\n", fn);
+            exit(1);
+        }
+        const byte* data = s + m.offset;
+        if (m.depth > 8) { // big endian samples
+            const int n = m.w * m.h * m.c * 2;
+            worker_reserve(worker, 0, n);
+            if (!swap16(worker->copy, data, n, m.maxval)) {
+                fprintf(stderr, "%s: samples exceed maxval\n", fn);
+                exit(1);
+            }
+            data = worker->copy;
+        }
+        compress(file, class_of_files, data, m.w, m.h, m.c, m.depth, worker);
+        pnm_write(out, &m, worker->decoded);
+        mem_unmap(s, bytes);
+    } else {
+        int w = 0;
+        int h = 0;
+        int c = 0;
+        byte* data = stbi_load(fn, &w, &h, &c, 0);
+        assert(1 <= c && c <= 4);
+        compress(file, class_of_files, data, w, h, c, 8, worker);
+        stbi_write_png(out, w, h, c, worker->decoded, 0);
+        stbi_image_free(data);
+    }
+}
+
+// file_encode() maps raw (-r WxHxC) or PGM/PPM input and codes it straight
+// into output file mapped with worst case size, truncated to the stream after.
+// file_decode() maps the stream and decodes it into the mapped raw output
+// (or PGM/PPM if output name says so). Both return 0 or errno (and remove the
+// output then), EIO if the decoded samples do not match the stream checksum.
+
+static int file_encode(const char* input, const char* output, int* stream_bytes) {
+    int bytes = 0;
+    byte* s = (byte*)mem_map(input, &bytes, true);
+    if (s == null) { return errno != 0 ? errno : EINVAL; }
+    pnm_t m = { options.raw_w, options.raw_h, options.raw_c, 0xFF, 8, 0 };
+    bool ok = options.raw_w > 0 ?
+        m.h > 0 && 1 <= m.c && m.c <= 4 && (int64_t)m.w * m.h * m.c <= bytes :
+        pnm_parse(s, bytes, &m);
+    const int n = ok ? m.w * m.h * m.c * (m.depth > 8 ? 2 : 1) : 0;
+    byte* samples = s + m.offset;
+    if (ok && m.depth > 8) { // big endian samples
+        samples = (byte*)malloc(n);
+        ok = samples != null && swap16(samples, s + m.offset, n, m.maxval);
+    }
+    int r = ok ? 0 : EINVAL;
+    if (ok) {
+        bdgr_format_t f = left_format(m.w, m.h, m.c, m.depth);
+        f.transform = m.c >= 3 ? bdgr_transform_rct : 0;
+        f.checksum = options.checksum;
+        const int max_bytes = bdgr_max_bytes(&f);
+        byte* d = (byte*)mem_map_create(output, max_bytes);
+        if (d == null) {
+            r = errno;
+        } else {
+            bdgr_context_t context;
+            const bdgr_allocator_t allocator = { context_allocate, context_release, null };
+            bdgr_context_init(&context, &allocator);
+            codec_t ce = { &f, samples, 0, d, max_bytes, &context };
+            const int k = encode(&ce);
+            bdgr_context_done(&context);
+            mem_unmap(d, max_bytes);
+            r = k > 0 ? file_resize(output, k) : ENOSPC;
+            *stream_bytes = k;
+            if (r != 0) { remove(output); }
+        }
+    }
+    if (samples != s + m.offset) { free(samples); }
+    mem_unmap(s, bytes);
+    return r;
+}
+
+static int file_decode(const char* input, const char* output, int* image_bytes) {
+    int bytes = 0;
+    byte* s = (byte*)mem_map(input, &bytes, true);
+    if (s == null) { return errno != 0 ? errno : EINVAL; }
+    bdgr_format_t f;
+    int r = bdgr_format_checked(s, bytes, &f) == 0 ? 0 : EINVAL;
+    const pnm_t m = { f.w, f.h, f.channels, (1 << f.depth) - 1, f.depth, 0 };
+    const bool pnm = is_pnm(output);
+    if (r == 0 && pnm && m.c != 1 && m.c != 3) { r = EINVAL; }
+    if (r == 0) {
+        char header[64];
+        const int k = pnm ? pnm_header(header, &m) : 0;
+        const int n = f.w * f.h * f.channels * (f.depth > 8 ? 2 : 1);
+        byte* d = (byte*)mem_map_create(output, k + n);
+        if (d == null) {
+            r = errno;
+        } else {
+            memcpy(d, header, k);
+            const int e = bdgr_decode_checked(s, bytes, d + k, n, null);
+            r = e == n ? 0 : e == bdgr_error_checksum ? EIO : EINVAL;
+            if (pnm && f.depth > 8) { swap16(d + k, d + k, n, 0xFFFF); } // to big endian
+            mem_unmap(d, k + n);
+            *image_bytes = k + n;
+            if (r != 0) { remove(output); } // never leave wrong pixels behind
+        }
+    }
+    mem_unmap(s, bytes);
+    return r;
+}
+
+static int file_codec(int argc, const char* argv[]) { // -e or -d input output
+    if (argc != 3) {
+        fprintf(stderr, "usage: bdgr -e [-k] [-a 1|2] [-r WxH[xC]] input.pgm|ppm|raw output.bdgr\n"
+                        "       bdgr -d input.bdgr output.pgm|ppm|raw\n");
+        return 1;
+    }
+    int k = 0;
+    const double time = time_in_seconds();
+    const int r = options.encode ? file_encode(argv[1], argv[2], &k) : file_decode(argv[1], argv[2], &k);
+    if (r != 0) {
+        fprintf(stderr, "%s failed: %s\n", argv[1], strerror(r));
+        return 1;
+    }
+    printf("%s -> %s %d bytes in %.4fs\n", argv[1], argv[2], k, time_in_seconds() - time);
+    return 0;
+}
+
+// synthetic images stress separate paths of the codec: flat and text pages
+// the run mode, smooth gradients short Rice codes, noise of growing sigma
+// longer codes and random pixels the escapes and stored stripes
+
+enum { synthetic_flat, synthetic_gradient, synthetic_noise, synthetic_random, synthetic_text };
+
+typedef struct synthetic_s {
+    const char* name; // also class of the image
+    int kind;
+    int sigma; // of gaussian noise added to gradient
+    int w;
+    int h;
+    int c;
+} synthetic_t;
+
+static const synthetic_t synthetics[] = {
+    { "flat",     synthetic_flat,      0,   640,    480, 1 },
+    { "gradient", synthetic_gradient,  0,   640,    480, 1 },
+    { "gradient", synthetic_gradient,  0,   640,    480, 3 },
+    { "noise1",   synthetic_noise,     1,   640,    480, 1 },
+    { "noise4",   synthetic_noise,     4,   640,    480, 1 },
+    { "noise16",  synthetic_noise,    16,   640,    480, 1 },
+    { "noise64",  synthetic_noise,    64,   640,    480, 1 },
+    { "noise4",   synthetic_noise,     4,   640,    480, 3 },
+    { "random",   synthetic_random,    0,   640,    480, 1 },
+    { "text",     synthetic_text,      0,  1024,   1024, 1 },
+    { "wide",     synthetic_noise,     4, 0xFFFF,    64, 1 }, // largest short headers
+    { "tall",     synthetic_noise,     4,    64, 0xFFFF, 1 },
+    { "panorama", synthetic_noise,     4, 100000,    48, 3 }, // container header
+    { "large",    synthetic_noise,     4,  4096,   4096, 1 }
+};
+
+static uint32_t random32(uint32_t* seed) { // xorshift, same images on all platforms
+    uint32_t x = *seed;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    *seed = x;
+    return x;
+}
+
+static int gaussian(uint32_t* seed, int sigma) { // sum of 12 uniforms has sigma 4096
+    int sum = 0;
+    for (int i = 0; i < 12; i++) { sum += random32(seed) >> 20; }
+    return (sum - 12 * 4095 / 2) * sigma / 4096;
+}
+
+static void synthesize(const synthetic_t* s, byte* p) {
+    const int w = s->w;
+    const int h = s->h;
+    const int c = s->c;
+    uint32_t seed = 0x2545F491;
+    if (s->kind == synthetic_flat) {
+        memset(p, 0x80, w * h * c);
+    } else if (s->kind == synthetic_random) {
+        for (int i = 0; i < w * h * c; i++) { p[i] = (byte)(random32(&seed) >> 24); }
+    } else if (s->kind == synthetic_text) {
+        memset(p, 0xF0, w * h * c); // paper
+        for (int y = 8; y + 7 < h - 8; y += 12) { // lines of 5x7 glyphs
+            for (int x = 8; x + 5 < w - 8; x += 6) {
+                if (random32(&seed) % 6 == 0) { continue; } // space between words
+                uint64_t glyph = 0; // ~1/4 of 35 bits are ink
+                for (int j = 0; j < 2; j++) { glyph = glyph << 32 | (random32(&seed) & random32(&seed)); }
+                for (int i = 0; i < 35; i++) {
+                    if ((glyph >> i) & 1) { memset(p + ((y + i / 5) * w + x + i % 5) * c, 0x20, c); }
+                }
+            }
+        }
+    } else {
+        for (int y = 0; y < h; y++) {
+            for (int x = 0; x < w; x++) {
+                for (int i = 0; i < c; i++) { // channels ramp in different directions
+                    const int v = ((i % 2 == 0 ? x : w - 1 - x) * 255 / (w - 1) +
+                                   y * 255 / (h - 1) * i) / (i + 1);
+                    const int n = s->sigma > 0 ? v + gaussian(&seed, s->sigma) : v;
+                    p[(y * w + x) * c + i] = (byte)(n < 0 ? 0 : n > 255 ? 255 : n);
+                }
+            }
+        }
+    }
+}
+
+static void synthetic_compress(worker_t* worker) {
+    for (int i = 0; i < (int)countof(synthetics); i++) {
+        const synthetic_t* s = &synthetics[i];
+        byte* data = (byte*)malloc(s->w * s->h * s->c);
+        if (data == null) { perror("out of memory"); exit(1); }
+        synthesize(s, data);
+        char name[64];
+        snprintf(name, sizeof(name), "%s.%dx%dx%d", s->name, s->w, s->h, s->c);
+        compress(name, s->name, data, s->w, s->h, s->c, 8, worker);
+        free(data);
+    }
+}
+
+// synthetic_sequence() codes frames of a static scene (1/64 of the pixels
+// flicker between frames) as keyframes and with temporal prediction
+
+static void synthetic_sequence(worker_t* worker) {
+    enum { w = 640, h = 480, frames = 30, keyframes = 10 };
+    bdgr_format_t f = left_format(w, h, 1, 8);
+    f.model = bdgr_model_runs;
+    const int max_bytes = bdgr_max_bytes(&f);
+    worker_reserve(worker, max_bytes, w * h);
+    byte* scene = (byte*)malloc(w * h * 3); // and two frames
+    if (scene == null) { perror("out of memory"); exit(1); }
+    const synthetic_t s = { "scene", synthetic_gradient, 4, w, h, 1 };
+    synthesize(&s, scene);
+    uint32_t seed = 1;
+    bdgr_sequence_t encoder;
+    bdgr_sequence_t decoder;
+    bdgr_sequence_init(&encoder, &worker->context, keyframes);
+    bdgr_sequence_init(&decoder, &worker->context, keyframes);
+    int64_t intra = 0;
+    int64_t temporal = 0;
+    for (int i = 0; i < frames; i++) {
+        byte* frame = scene + w * h * (1 + i % 2); // previous frame stays intact
+        for (int j = 0; j < w * h; j++) { frame[j] = scene[j] + (random32(&seed) % 64 == 0); }
+        intra += bdgr_encode_ex(frame, &f, worker->encoded, max_bytes);
+        const int k = bdgr_encode_frame(&encoder, frame, w, &f, worker->encoded, max_bytes);
+        temporal += k;
+        byte* decoded = i % 2 ? worker->copy : worker->decoded;
+        if (k <= 0 || bdgr_decode_frame(&decoder, worker->encoded, k, decoded, w) != w * h ||
+            memcmp(decoded, frame, w * h) != 0) {
+            fprintf(stderr, "sequence frame %d: decoded != original\n", i);
+            exit(1);
+        }
+    }
+    fprintf(summary(), "sequence.%dx%dx1 %d frames keyframe every %d: %lld bytes, keyframes only %lld (%.2fx)\n",
+            w, h, frames, keyframes, (long long)temporal, (long long)intra, (double)intra / temporal);
+    free(scene);
+}
+
+// synthetic_progressive() codes odd sized noisy RGB gradient progressively
+// and decodes every level from its prefix of the stream only
+
+static void synthetic_progressive(worker_t* worker) {
+    enum { w = 641, h = 479, c = 3, levels = 3 };
+    bdgr_format_t f = left_format(w, h, c, 8);
+    f.model = bdgr_model_runs;
+    const int max_bytes = bdgr_progressive_max_bytes(&f, levels);
+    worker_reserve(worker, max_bytes > bdgr_max_bytes(&f) ? max_bytes : bdgr_max_bytes(&f), w * h * c);
+    byte* image = (byte*)malloc(w * h * c);
+    if (image == null) { perror("out of memory"); exit(1); }
+    const synthetic_t s = { "preview", synthetic_noise, 4, w, h, c };
+    synthesize(&s, image);
+    const int full = bdgr_encode_ex(image, &f, worker->encoded, bdgr_max_bytes(&f));
+    const int k = bdgr_encode_progressive(&worker->context, image, w * c, &f, levels,
+                                          worker->encoded, max_bytes);
+    if (k <= 0) { fprintf(stderr, "progressive: failed to encode\n"); exit(1); }
+    fprintf(summary(), "progressive.%dx%dx%d %d bytes, bdgr_encode %d:", w, h, c, k, full);
+    for (int level = levels; level >= 0; level--) {
+        bdgr_format_t l;
+        const int prefix = bdgr_progressive_bytes(worker->encoded, k, level, &l);
+        const int stride = l.w * c;
+        bool same = prefix > 0 && bdgr_decode_progressive(&worker->context, worker->encoded,
+            prefix, level, worker->decoded, stride) == stride * l.h &&
+            bdgr_decode_progressive(&worker->context, worker->encoded, prefix - 8, level,
+            worker->copy, stride) < 0;
+        for (int y = 0; y < l.h && same; y++) {
+            for (int x = 0; x < l.w && same; x++) {
+                same = memcmp(worker->decoded + y * stride + x * c,
+                              image + ((y << level) * w + (x << level)) * c, c) == 0;
+            }
+        }
+        if (!same) { fprintf(stderr, "progressive level %d: decoded != original\n", level); exit(1); }
+        fprintf(summary(), " 1/%d %dx%d %d", 1 << level, l.w, l.h, prefix);
+    }
+    fprintf(summary(), "\n");
+    free(image);
 }
 
 static void straighten(char* pathname) {
     while (strchr(pathname, '\\') != null) { *strchr(pathname, '\\') = '/'; }
 }
 
-static void compress_folder(const char* folder_name) {
-    folder_t folders = folder_open();
-    int r = folder_enumerate(folders, folder_name);
-    if (r != 0) { perror("failed to open folder"); exit(1); }
-    const char* folder = folder_foldername(folders);
-    const int n = folder_count(folders);
-    for (int i = 0; i < n; i++) {
-        const char* name = folder_filename(folders, i);
-        int pathname_length = (int)(strlen(folder) + strlen(name) + 3);
+typedef struct queue_s { // of the files of a folder
+    folder_t    folders;
+    const char* folder;
+    int         count;
+    volatile int next;    // next file to compress, taken by atomic increment
+    volatile int started; // threads, each takes worker[started]
+    worker_t    worker[64];
+} queue_t;
+
+static void compress_files(queue_t* q, worker_t* worker) {
+    for (;;) {
+        const int i = atomic_fetch_increment(&q->next);
+        if (i >= q->count) { break; }
+        const char* name = folder_filename(q->folders, i);
+        int pathname_length = (int)(strlen(q->folder) + strlen(name) + 3);
         char* pathname = (char*)calloc(1, pathname_length);
         if (pathname == null) { break; }
-        snprintf(pathname, pathname_length, "%s/%s", folder, name);
+        snprintf(pathname, pathname_length, "%s/%s", q->folder, name);
         straighten(pathname);
-        image_compress(pathname);
+        image_compress(pathname, worker);
         free(pathname);
     }
-    folder_close(folders);
+}
+
+#ifdef WIN32
+
+static DWORD WINAPI compress_thread(void* p) {
+    queue_t* q = (queue_t*)p;
+    compress_files(q, &q->worker[atomic_fetch_increment(&q->started)]);
+    return 0;
+}
+
+#else
+
+static void* compress_thread(void* p) {
+    queue_t* q = (queue_t*)p;
+    compress_files(q, &q->worker[atomic_fetch_increment(&q->started)]);
+    return null;
+}
+
+#endif
+
+// compress_folder() with jobs > 1 compresses files on `jobs` threads which
+// take next file from the shared queue as soon as they are done with one
+
+static void compress_folder(const char* folder_name, int jobs) {
+    static queue_t q;
+    memset(&q, 0, sizeof(q));
+    q.folders = folder_open();
+    int r = folder_enumerate(q.folders, folder_name);
+    if (r != 0) { perror("failed to open folder"); exit(1); }
+    q.folder = folder_foldername(q.folders);
+    q.count = folder_count(q.folders);
+    jobs = jobs < (int)countof(q.worker) ? jobs : (int)countof(q.worker);
+    const double time = time_in_seconds();
+    if (jobs <= 1) {
+        compress_files(&q, &q.worker[0]);
+    } else {
+        #ifdef WIN32
+            HANDLE threads[countof(q.worker)];
+            for (int i = 0; i < jobs; i++) { threads[i] = CreateThread(null, 0, compress_thread, &q, 0, null); }
+            WaitForMultipleObjects(jobs, threads, true, INFINITE);
+            for (int i = 0; i < jobs; i++) { CloseHandle(threads[i]); }
+        #else
+            pthread_t threads[countof(q.worker)];
+            for (int i = 0; i < jobs; i++) { pthread_create(&threads[i], null, compress_thread, &q); }
+            for (int i = 0; i < jobs; i++) { pthread_join(threads[i], null); }
+        #endif
+    }
+    const double seconds = time_in_seconds() - time;
+    int64_t bytes = 0;
+    int count = 0;
+    for (int i = 0; i < (int)countof(q.worker); i++) {
+        bytes += q.worker[i].bytes_sum;
+        count += q.worker[i].run_count;
+        worker_done(&q.worker[i]);
+    }
+    fprintf(summary(), "%s: %d images %.1fMB in %.3fs %.1fMB/s on %d thread%s\n", folder_name, count,
+           bytes / (1024.0 * 1024.0), seconds, bytes / (1024.0 * 1024.0) / seconds,
+           jobs > 1 ? jobs : 1, jobs > 1 ? "s" : "");
+    folder_close(q.folders);
+}
+
+// pipeline: `bdgr -p [-j N] [-k] [-a N] folder output` encodes every image of
+// the folder into output/name.ext.bdgr. Reader thread reads files ahead into free
+// slots, `jobs` threads encode them and writer thread writes the streams and
+// returns slots to the pool. Slots keep their grown buffers and their number
+// bounds read-ahead, so throughput is that of the slowest stage. Blocking
+// reads and writes on their own threads overlap with encoding.
+
+#ifdef WIN32
+    typedef SRWLOCK mutex_t;
+    typedef CONDITION_VARIABLE condition_t;
+    #define mutex_init(m)          InitializeSRWLock(m)
+    #define mutex_lock(m)          AcquireSRWLockExclusive(m)
+    #define mutex_unlock(m)        ReleaseSRWLockExclusive(m)
+    #define mutex_dispose(m)       (void)(m)
+    #define condition_init(c)      InitializeConditionVariable(c)
+    #define condition_wait(c, m)   SleepConditionVariableSRW(c, m, INFINITE, 0)
+    #define condition_broadcast(c) WakeAllConditionVariable(c)
+    #define condition_dispose(c)   (void)(c)
+#else
+    typedef pthread_mutex_t mutex_t;
+    typedef pthread_cond_t condition_t;
+    #define mutex_init(m)          pthread_mutex_init(m, null)
+    #define mutex_lock(m)          pthread_mutex_lock(m)
+    #define mutex_unlock(m)        pthread_mutex_unlock(m)
+    #define mutex_dispose(m)       pthread_mutex_destroy(m)
+    #define condition_init(c)      pthread_cond_init(c, null)
+    #define condition_wait(c, m)   pthread_cond_wait(c, m)
+    #define condition_broadcast(c) pthread_cond_broadcast(c)
+    #define condition_dispose(c)   pthread_cond_destroy(c)
+#endif
+
+typedef struct slot_s { // of a file in flight, buffers grow and are reused
+    char  name[256];    // of the file in the folder
+    byte* file;
+    int   file_bytes;
+    int   file_max;     // allocated
+    byte* samples;      // 16 bit PNM samples in host byte order
+    int   samples_max;
+    byte* stream;
+    int   stream_bytes; // 0 if file is not an image
+    int   stream_max;
+    int   image_bytes;  // of samples
+} slot_t;
+
+enum { pipeline_slots = 2 * 64 + 2 }; // 2 * jobs + 2: one read ahead and one queued per encoder
+
+typedef struct pipe_s { // bounded queue of slots
+    mutex_t     lock;
+    condition_t ready;
+    slot_t*     slot[pipeline_slots];
+    int         head;
+    int         count;
+    bool        closed; // nothing will be put anymore
+} pipe_t;
+
+static void pipe_init(pipe_t* q) {
+    memset(q, 0, sizeof(*q));
+    mutex_init(&q->lock);
+    condition_init(&q->ready);
+}
+
+static void pipe_put(pipe_t* q, slot_t* s) { // never waits: holds less than all slots
+    mutex_lock(&q->lock);
+    assert(q->count < pipeline_slots);
+    q->slot[(q->head + q->count) % pipeline_slots] = s;
+    q->count++;
+    condition_broadcast(&q->ready);
+    mutex_unlock(&q->lock);
+}
+
+static slot_t* pipe_get(pipe_t* q) { // waits for a slot, null when closed and empty
+    mutex_lock(&q->lock);
+    while (q->count == 0 && !q->closed) { condition_wait(&q->ready, &q->lock); }
+    slot_t* s = null;
+    if (q->count > 0) {
+        s = q->slot[q->head];
+        q->head = (q->head + 1) % pipeline_slots;
+        q->count--;
+    }
+    mutex_unlock(&q->lock);
+    return s;
+}
+
+static void pipe_close(pipe_t* q) {
+    mutex_lock(&q->lock);
+    q->closed = true;
+    condition_broadcast(&q->ready);
+    mutex_unlock(&q->lock);
+}
+
+static void pipe_dispose(pipe_t* q) {
+    condition_dispose(&q->ready);
+    mutex_dispose(&q->lock);
+}
+
+typedef struct pipeline_s {
+    folder_t    folders;
+    const char* folder;
+    const char* output; // folder
+    int         count;  // of files in the folder
+    int         jobs;   // encoding threads
+    pipe_t      free;   // pool of slots
+    pipe_t      loaded; // read by reader, waiting for encoders
+    pipe_t      encoded; // waiting for writer
+    slot_t      slots[pipeline_slots];
+    volatile int finished; // encoders, the last one closes `encoded`
+    double      read_time;  // busy seconds of the stage
+    double      encode_time[64];
+    double      write_time;
+    int64_t     image_bytes;
+    int64_t     stream_bytes;
+    int         images;
+    int         skipped; // not images
+    int         failed;  // to read or write
+} pipeline_t;
+
+static byte* reserve(byte** p, int* allocated, int bytes) { // grows, never shrinks
+    if (bytes > *allocated) {
+        byte* a = (byte*)realloc(*p, bytes);
+        if (a == null) { return null; }
+        *p = a;
+        *allocated = bytes;
+    }
+    return *p;
+}
+
+static void pipeline_read(pipeline_t* p, int unused) {
+    (void)unused;
+    for (int i = 0; i < p->count; i++) {
+        if (folder_is_folder(p->folders, i)) { continue; }
+        slot_t* s = pipe_get(&p->free); // waits while all slots are in flight
+        const double time = time_in_seconds();
+        snprintf(s->name, sizeof(s->name), "%s", folder_filename(p->folders, i));
+        char pathname[1024];
+        snprintf(pathname, sizeof(pathname), "%s/%s", p->folder, s->name);
+        straighten(pathname);
+        FILE* f = fopen(pathname, "rb");
+        struct stat st;
+        const bool ok = f != null && fstat(fileno(f), &st) == 0 && st.st_size <= 0x7FFFFFFF &&
+            reserve(&s->file, &s->file_max, (int)st.st_size + 1) != null &&
+            fread(s->file, 1, (size_t)st.st_size, f) == (size_t)st.st_size;
+        s->file_bytes = ok ? (int)st.st_size : -1;
+        if (f != null) { fclose(f); }
+        p->read_time += time_in_seconds() - time;
+        pipe_put(&p->loaded, s);
+    }
+    pipe_close(&p->loaded);
+}
+
+// slot_encode() parses PNM or decodes other formats by stb_image from the
+// file contents and encodes samples into `stream`, returns its bytes or 0
+
+static int slot_encode(slot_t* s, bdgr_context_t* context) {
+    pnm_t m = { 0, 0, 0, 0xFF, 8, 0 };
+    const byte* samples = null;
+    byte* loaded = null; // by stb_image
+    if (pnm_parse(s->file, s->file_bytes, &m)) {
+        samples = s->file + m.offset;
+        if (m.depth > 8) { // big endian samples
+            const int n = m.w * m.h * m.c * 2;
+            const bool ok = reserve(&s->samples, &s->samples_max, n) != null &&
+                            swap16(s->samples, samples, n, m.maxval);
+            samples = ok ? s->samples : null;
+        }
+    } else if (s->file_bytes > 0) {
+        loaded = stbi_load_from_memory(s->file, s->file_bytes, &m.w, &m.h, &m.c, 0);
+        samples = loaded;
+    }
+    int k = 0;
+    if (samples != null) {
+        bdgr_format_t f = left_format(m.w, m.h, m.c, m.depth);
+        f.transform = m.c >= 3 ? bdgr_transform_rct : 0;
+        f.checksum = options.checksum;
+        const int max_bytes = bdgr_max_bytes(&f);
+        if (reserve(&s->stream, &s->stream_max, max_bytes) != null) {
+            codec_t ce = { &f, samples, 0, s->stream, max_bytes, context };
+            k = encode(&ce);
+        }
+        s->image_bytes = m.w * m.h * m.c * (m.depth > 8 ? 2 : 1);
+    }
+    if (loaded != null) { stbi_image_free(loaded); }
+    return k > 0 ? k : 0;
+}
+
+static void pipeline_encode(pipeline_t* p, int i) {
+    bdgr_context_t context;
+    const bdgr_allocator_t allocator = { context_allocate, context_release, null };
+    bdgr_context_init(&context, &allocator);
+    for (;;) {
+        slot_t* s = pipe_get(&p->loaded);
+        if (s == null) { break; }
+        const double time = time_in_seconds();
+        s->stream_bytes = slot_encode(s, &context);
+        p->encode_time[i] += time_in_seconds() - time;
+        pipe_put(&p->encoded, s);
+    }
+    bdgr_context_done(&context);
+    if (atomic_fetch_increment(&p->finished) == p->jobs - 1) { pipe_close(&p->encoded); }
+}
+
+static void pipeline_write(pipeline_t* p, int unused) {
+    (void)unused;
+    for (;;) {
+        slot_t* s = pipe_get(&p->encoded);
+        if (s == null) { break; }
+        const double time = time_in_seconds();
+        if (s->stream_bytes > 0) {
+            char filename[1024]; // full source name: a.pgm and a.png must not collide
+            snprintf(filename, sizeof(filename), "%s/%s.bdgr", p->output, s->name);
+            FILE* f = fopen(filename, "wb");
+            bool ok = f != null && fwrite(s->stream, 1, s->stream_bytes, f) == (size_t)s->stream_bytes;
+            if (f != null && fclose(f) != 0) { ok = false; }
+            if (ok) {
+                p->images++;
+                p->image_bytes += s->image_bytes;
+                p->stream_bytes += s->stream_bytes;
+            } else {
+                fprintf(stderr, "failed to write %s: %s\n", filename, strerror(errno));
+                p->failed++;
+            }
+        } else if (s->file_bytes < 0) {
+            fprintf(stderr, "failed to read %s/%s\n", p->folder, s->name);
+            p->failed++;
+        } else {
+            p->skipped++;
+        }
+        p->write_time += time_in_seconds() - time;
+        pipe_put(&p->free, s);
+    }
+}
+
+typedef struct stage_s { // of a pipeline thread
+    pipeline_t* p;
+    void (*run)(pipeline_t* p, int i);
+    int i;
+} stage_t;
+
+#ifdef WIN32
+
+static DWORD WINAPI pipeline_thread(void* p) {
+    stage_t* s = (stage_t*)p;
+    s->run(s->p, s->i);
+    return 0;
+}
+
+#else
+
+static void* pipeline_thread(void* p) {
+    stage_t* s = (stage_t*)p;
+    s->run(s->p, s->i);
+    return null;
+}
+
+#endif
+
+static int pipeline_folder(int argc, const char* argv[]) {
+    if (argc != 3 || !is_folder(argv[1])) {
+        fprintf(stderr, "usage: bdgr -p [-j N] [-k] [-a 1|2] input_folder output_folder\n");
+        return 1;
+    }
+    static pipeline_t p;
+    memset(&p, 0, sizeof(p));
+    p.folders = folder_open();
+    if (folder_enumerate(p.folders, argv[1]) != 0) { perror("failed to open folder"); return 1; }
+    p.folder = folder_foldername(p.folders);
+    p.count  = folder_count(p.folders);
+    p.output = argv[2];
+    #ifndef WIN32
+        mkdir(p.output, S_IRWXU | S_IRWXG | S_IROTH | S_IXOTH);
+    #else
+        mkdir(p.output);
+    #endif
+    p.jobs = options.jobs < 1 ? 1 : options.jobs > 64 ? 64 : options.jobs;
+    pipe_init(&p.free);
+    pipe_init(&p.loaded);
+    pipe_init(&p.encoded);
+    for (int i = 0; i < 2 * p.jobs + 2; i++) { pipe_put(&p.free, &p.slots[i]); }
+    stage_t stages[64 + 2];
+    const int n = p.jobs + 2;
+    stages[0] = (stage_t){ &p, pipeline_read, 0 };
+    stages[1] = (stage_t){ &p, pipeline_write, 0 };
+    for (int i = 0; i < p.jobs; i++) { stages[i + 2] = (stage_t){ &p, pipeline_encode, i }; }
+    const double time = time_in_seconds();
+    #ifdef WIN32
+        HANDLE threads[countof(stages)];
+        for (int i = 0; i < n; i++) { threads[i] = CreateThread(null, 0, pipeline_thread, &stages[i], 0, null); }
+        WaitForMultipleObjects(n, threads, true, INFINITE);
+        for (int i = 0; i < n; i++) { CloseHandle(threads[i]); }
+    #else
+        pthread_t threads[countof(stages)];
+        for (int i = 0; i < n; i++) { pthread_create(&threads[i], null, pipeline_thread, &stages[i]); }
+        for (int i = 0; i < n; i++) { pthread_join(threads[i], null); }
+    #endif
+    const double seconds = time_in_seconds() - time;
+    double encode_time = 0;
+    for (int i = 0; i < p.jobs; i++) { encode_time += p.encode_time[i]; }
+    const double mb = p.image_bytes / (1024.0 * 1024.0);
+    printf("%s: %d images %.1fMB -> %.1fMB in %.3fs %.1fMB/s busy: read %.3fs encode %.3fs (x%d) write %.3fs\n",
+           argv[1], p.images, mb, p.stream_bytes / (1024.0 * 1024.0), seconds, mb / seconds,
+           p.read_time, encode_time / p.jobs, p.jobs, p.write_time);
+    if (p.skipped > 0) { printf("%d files skipped: not images\n", p.skipped); }
+    for (int i = 0; i < (int)countof(p.slots); i++) {
+        free(p.slots[i].file);
+        free(p.slots[i].samples);
+        free(p.slots[i].stream);
+    }
+    pipe_dispose(&p.free);
+    pipe_dispose(&p.loaded);
+    pipe_dispose(&p.encoded);
+    folder_close(p.folders);
+    return p.failed > 0 ? 1 : 0;
 }
 
 static int run(int argc, const char* argv[]) {
     setbuf(stdout, null);
-    image_compress("thermo-foil.png");
-    image_compress("greyscale.128x128.pgm");
-    image_compress("greyscale.640x480.pgm");
-    image_compress("lena512.png");
+    if (options.encode || options.decode) { return file_codec(argc, argv); }
+    if (options.pipeline) { return pipeline_folder(argc, argv); }
+    if (options.format == format_csv) {
+        printf("name,class,w,h,channels,bytes,encoded,bpp,percent,"
+               "encode_min_ms,encode_median_ms,encode_p99_ms,encode_mb_per_s,encode_cycles_per_pixel,"
+               "decode_min_ms,decode_median_ms,decode_p99_ms,decode_mb_per_s,decode_cycles_per_pixel\n");
+    } else if (options.format == format_json) {
+        printf("[\n");
+    }
+    worker_t worker;
+    memset(&worker, 0, sizeof(worker));
+    image_compress("thermo-foil.png", &worker);
+    image_compress("greyscale.128x128.pgm", &worker);
+    image_compress("greyscale.640x480.pgm", &worker);
+    image_compress("lena512.png", &worker);
+    if (options.synthetic) {
+        synthetic_compress(&worker);
+        synthetic_sequence(&worker);
+        synthetic_progressive(&worker);
+    }
+    worker_done(&worker);
     while (argc > 1 && is_folder(argv[1])) {
-        compress_folder(argv[1]);
+        compress_folder(argv[1], options.jobs);
         memmove(&argv[1], &argv[2], (argc - 2) * sizeof(argv[1]));
         argc--;
     }
-    printf("average %.2f%c encode %.1fms decode %.1fms\n", percentage_sum / run_count, '%',
-           (encode_time_sum / run_count) * 1000, (decode_time_sum / run_count) * 1000);
+    if (options.format == format_json) { printf("]\n"); }
+    fprintf(summary(), "average %.2f%c encode %.1fms decode %.1fms\n", percentage_sum / run_count, '%',
+            (encode_time_sum / run_count) * 1000, (decode_time_sum / run_count) * 1000);
     return 0;
 }
 
+// options anywhere in the arguments: "-j N" (or "-jN"), "-b", "-n N", "-t S",
+// "-s", "-f csv" or "-f json", "-e", "-d", "-r WxH[xC]", "-k", "-a N", "-p"
+
+static void parse_options(int* argc, const char* argv[]) {
+    for (int i = 1; i < *argc; i++) {
+        const char* a = argv[i];
+        if (a[0] != '-' || strchr("jbntsfedrkap", a[1]) == null || a[1] == 0) { continue; }
+        const bool flag = strchr("bsedkp", a[1]) != null; // without value
+        const bool separate = !flag && a[2] == 0 && i + 1 < *argc;
+        const char* v = separate ? argv[i + 1] : a + 2;
+        switch (a[1]) {
+            case 'j': options.jobs = atoi(v); break;
+            case 'b': options.bench = true; break;
+            case 'n': options.runs = atoi(v) > 0 ? atoi(v) : 1; break;
+            case 't': options.seconds = atof(v); break;
+            case 's': options.synthetic = true; break;
+            case 'f': options.format = strcmp(v, "csv") == 0 ? format_csv :
+                                       strcmp(v, "json") == 0 ? format_json : format_text; break;
+            case 'e': options.encode = true; break;
+            case 'd': options.decode = true; break;
+            case 'k': options.checksum = true; break;
+            case 'p': options.pipeline = true; break;
+            case 'a': options.effort = atoi(v) < 0 ? 0 : atoi(v) > 2 ? 2 : atoi(v); break;
+            case 'r': options.raw_c = 1;
+                      sscanf(v, "%dx%dx%d", &options.raw_w, &options.raw_h, &options.raw_c); break;
+        }
+        const int n = separate ? 2 : 1;
+        memmove(&argv[i], &argv[i + n], (*argc - i - n) * sizeof(argv[i]));
+        *argc -= n;
+        i--;
+    }
+}
+
 int main(int argc, const char* argv[]) {
-    #ifdef WIN32
-        SetPriorityClass(GetCurrentProcess(), REALTIME_PRIORITY_CLASS);
-        SetThreadPriority(GetCurrentThread(), THREAD_PRIORITY_TIME_CRITICAL);
-        SetThreadAffinityMask(GetCurrentThread(), 1);
-    #else
-        int policy = 0;
-        struct sched_param param = {};
-        pthread_getschedparam(pthread_self(), &policy, &param);
-        param.sched_priority = sched_get_priority_max(policy);
-        pthread_setschedparam(pthread_self(), policy, &param);
-        #ifdef __linux__
-            pthread_setschedprio(pthread_self(), param.sched_priority);
-            cpu_set_t cpuset;
-            CPU_ZERO(&cpuset);
-            CPU_SET(0, &cpuset);
-            pthread_setaffinity_np(thread, sizeof(cpu_set_t), &cpuset);
+    parse_options(&argc, argv);
+    time_in_seconds(); // initialize before threads are started
+    if (options.jobs <= 1 && !options.pipeline) { // otherwise threads run on all processors at normal priority
+        #ifdef WIN32
+            SetPriorityClass(GetCurrentProcess(), REALTIME_PRIORITY_CLASS);
+            SetThreadPriority(GetCurrentThread(), THREAD_PRIORITY_TIME_CRITICAL);
+            SetThreadAffinityMask(GetCurrentThread(), 1);
+        #else
+            int policy = 0;
+            struct sched_param param = {};
+            pthread_getschedparam(pthread_self(), &policy, &param);
+            param.sched_priority = sched_get_priority_max(policy);
+            pthread_setschedparam(pthread_self(), policy, &param);
+            #ifdef __linux__
+                pthread_setschedprio(pthread_self(), param.sched_priority);
+                cpu_set_t cpuset;
+                CPU_ZERO(&cpuset);
+                CPU_SET(0, &cpuset);
+                pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &cpuset);
+            #endif
         #endif
-    #endif
-    run(argc, argv);
-    return 0;
+    }
+    return run(argc, argv);
 }
 
 #ifdef __cplusplus
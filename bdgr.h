@@ -11,6 +11,16 @@
 
 #ifdef _MSC_VER // using compiler identification instead of WIN32
 #include <intrin.h> // SSE & AVX
+#ifdef _M_ARM64
+#include <arm64_neon.h>
+#endif
+#elif defined(__SSE2__)
+#include <immintrin.h> // SSE2 & AVX2 (see bdgr_residuals_fn())
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+#if defined(__ARM_FEATURE_CRC32) && !defined(_MSC_VER)
+#include <arm_acle.h> // __crc32cd()
 #endif
 
 #ifdef __cplusplus
@@ -18,33 +28,385 @@ extern "C" {
 #endif
 
 // This is single header library - define BDGR_IMPLEMENTATION before including
-// Prerequisits: #include <stdint.h>
+// Prerequisits: #include <stdint.h> and <string.h>
 
-// Suggested output size at least 3-4 times of w * h
+// Output size of bdgr_max_bytes() always fits the stream (also delta frames of
+// bdgr_encode_temporal() that take container header). Encoders return 0
+// when the stream does not fit into max_bytes and never write past it.
+// Images (or stripes) that do not compress are stored verbatim instead, so
+// except for streaming encoder the stream never takes more than the samples
+// plus the header and 8 bytes of padding per stripe.
 // Important assumptions:
 // max_bytes must be multiples of 8!
-// w - width and h - height in pixels is encoded into output header and must be <= 0xFFFF
+// bytes passed to bdgr_decode() must be exactly what bdgr_encode() returned
+// w - width and h - height in pixels is encoded into output header, images of more
+// than 0xFFFF pixels per side get larger container header (see bdgr_encode_ex())
 // only correct for little endian processors
 
 int  bdgr_encode(const void* input, int w, int h, void* output, int max_bytes);
 void bdgr_header(const void* input, int *w, int *h);
 int  bdgr_decode(const void* input, int bytes, void* output, int w, int h);
 
+// bdgr_encode_ex() records format in the stream header, bdgr_decode() and
+// bdgr_header() handle both kinds of streams.
+
+enum { // predictors
+    bdgr_predictor_left = 0, // previous pixel in scan order - fastest, the one bdgr_encode() uses
+    bdgr_predictor_med  = 1  // LOCO-I/JPEG-LS median edge detector of left, above and upper-left pixels
+};
+
+enum { // colour transforms
+    bdgr_transform_none = 0,
+    bdgr_transform_rct  = 1  // reversible LOCO-I/JPEG-LS colour transform: R - G, G, B - G
+};
+
+enum { // Rice parameter models
+    bdgr_model_last    = 0, // from the last residual of the channel - fastest, bdgr_encode() one
+    bdgr_model_context = 1, // LOCO-I/JPEG-LS running averages in contexts of local gradients
+    bdgr_model_runs    = 2  // bdgr_model_context plus JPEG-LS run mode in flat regions
+};
+
+typedef struct bdgr_format_s {
+    int w;
+    int h;
+    int predictor;
+    int stripe;    // rows per independently coded stripe, 0 - whole image is one stripe
+    int channels;  // interleaved samples per pixel: 1 (0 means 1 too), 3 (RGB) or 4 (RGBA)
+    int transform; // applied to the first 3 channels before prediction, alpha as is
+    int depth;     // bits per sample 8 (0 means 8 too) or 9..16 for uint16_t samples
+    int model;     // of the Rice parameter
+    int checksum;  // 1: stream carries CRC32C of the samples of every stripe
+    int reference; // 1: coded against reference frame (see bdgr_encode_temporal())
+} bdgr_format_t;
+
+int  bdgr_encode_ex(const void* input, const bdgr_format_t* format, void* output, int max_bytes);
+void bdgr_format(const void* input, bdgr_format_t* format); // reads stream header
+int  bdgr_max_bytes(const bdgr_format_t* format); // worst case: every sample is an escape code
+
+// With format.checksum encoders compute CRC32C of every stripe and whole
+// image decoders verify it, both over rows that they have just touched (in
+// chunks that stay in cache) using crc32 instruction where it is available.
+// Decoders return bdgr_error_checksum if samples do not match (and whole
+// image decoders bdgr_error_truncated if codes of a stripe ran past its end).
+// Streaming and region decoders do not verify checksums.
+
+// bdgr_encode_interleaved() codes all channels in one pass over rows that are
+// `stride` bytes apart. bdgr_decode() writes w * h * channels packed samples
+// (of 2 bytes each for depth > 8) and returns number of bytes written.
+
+int bdgr_encode_interleaved(const void* input, int stride, const bdgr_format_t* format,
+                            void* output, int max_bytes);
+
+// bdgr_decode_interleaved() writes rows `stride` (>= w * channels * bytes per
+// sample) bytes apart directly into pitched surfaces (framebuffers, staging
+// buffers) and returns number of bytes of the rows written. Padding between
+// rows is not touched.
+
+int bdgr_decode_interleaved(const void* input, int bytes, void* output, int stride);
+
+// Stripes do not depend on each other and can be coded concurrently.
+// parallel_for(that, n, fn, context) must call fn(context, i) exactly once
+// for each i in [0..n) in any order on any threads and return after all
+// of the calls returned. bdgr does not create threads itself.
+// Parallel encode needs max_bytes to fit every stripe stored (header plus
+// w * h samples plus padding) otherwise it falls back to serial encoding.
+
+typedef void (*bdgr_stripe_fn_t)(void* context, int i);
+typedef void (*bdgr_parallel_for_t)(void* that, int n, bdgr_stripe_fn_t fn, void* context);
+
+int bdgr_encode_parallel(const void* input, const bdgr_format_t* format, void* output, int max_bytes,
+                         bdgr_parallel_for_t parallel_for, void* that);
+int bdgr_decode_parallel(const void* input, int bytes, void* output, int w, int h,
+                         bdgr_parallel_for_t parallel_for, void* that);
+
+// and the same for pitched surfaces:
+
+int bdgr_encode_interleaved_parallel(const void* input, int stride, const bdgr_format_t* format,
+                                     void* output, int max_bytes,
+                                     bdgr_parallel_for_t parallel_for, void* that);
+int bdgr_decode_interleaved_parallel(const void* input, int bytes, void* output, int stride,
+                                     bdgr_parallel_for_t parallel_for, void* that);
+
+// bdgr_decode_checked() is bdgr_decode() for untrusted input. It validates
+// header and stripes table against `bytes`, never reads past input + bytes
+// or writes past output + max_bytes. Returns number of bytes written or
+// negative bdgr_error_* (output content is undefined then). format may be null.
+
+enum {
+    bdgr_error_format    = -1, // malformed header or stripes table
+    bdgr_error_truncated = -2, // codes run past the end of the stream (stripe)
+    bdgr_error_output    = -3, // decoded image does not fit into max_bytes
+    bdgr_error_checksum  = -4, // decoded samples do not match stream checksum
+    bdgr_error_memory    = -5, // context allocator failed
+    bdgr_error_reference = -6  // stream needs reference frame (bdgr_decode_temporal())
+};
+
+int bdgr_decode_checked(const void* input, int bytes, void* output, int max_bytes,
+                        bdgr_format_t* format);
+
+// bdgr_format_checked() validates the stream like bdgr_decode_checked() but
+// decodes nothing: returns 0 and fills format or bdgr_error_format.
+
+int bdgr_format_checked(const void* input, int bytes, bdgr_format_t* format);
+
+/* Usage example (OpenMP):
+    static void omp_parallel_for(void* that, int n, bdgr_stripe_fn_t fn, void* context) {
+        #pragma omp parallel for
+        for (int i = 0; i < n; i++) { fn(context, i); }
+    }
+    bdgr_format_t f = { w, h, bdgr_predictor_med, 64 }; // 64 rows per stripe
+    int k = bdgr_encode_parallel(pixels, &f, output, max_bytes, omp_parallel_for, null);
+    bdgr_decode_parallel(output, k, pixels, w, h, omp_parallel_for, null);
+*/
+
+// Streaming: bdgr_encode_begin() writes the header, bdgr_encode_rows() codes
+// next n rows as they arrive and bdgr_encode_finish() returns the size of
+// the stream (or 0 if it does not fit into max_bytes). The stream is exactly
+// what bdgr_encode_interleaved() produces except that nothing is stored
+// because rows are not kept after the call.
+// bdgr_decode_begin() reads the header (into format if it is not null) and
+// bdgr_decode_rows() produces next n rows on demand.
+// With bdgr_predictor_med the last row of the previous call is the row above
+// the next one and must stay valid (and unchanged) until the next call.
+
+typedef struct bdgr_state_s { // all fields are private
+    uint64_t b64; // pending bits of the encoder
+    int count;    // number of pending bits
+    int bits[4];  // Rice parameter per channel
+    int a[4];     // previous sample in scan order per channel
+    int sum[4][20];   // bdgr_model_context: sum of rice values per channel and context
+    int codes[4][20]; // and number of codes in the sum
+    int run;          // bdgr_model_runs: index into bdgr_run_bits[] (JPEG-LS RUNindex)
+} bdgr_state_t;
+
+typedef struct bdgr_reader_s { // all fields are private
+    const uint8_t* stream; // current stripe
+    int bytes;
+    int tailed;   // reading zero padded copy of the last bytes in tail[]
+    int stored;   // verbatim samples, `at` is the offset of the next row
+    uint64_t at;  // offset of tail[] in the stripe
+    uint64_t pos; // bit position of the next code
+    uint64_t safe;
+    uint64_t tail[3];
+} bdgr_reader_t;
+
+typedef struct bdgr_encoder_s { // all fields are private
+    bdgr_format_t f;
+    uint8_t* output;
+    uint8_t* end;
+    uint64_t* p;
+    const uint8_t* above; // last row of the previous bdgr_encode_rows() call
+    int y;                // rows coded so far
+    bdgr_state_t state;
+    uint32_t crc;         // of the rows of the current stripe
+} bdgr_encoder_t;
+
+void bdgr_encode_begin(bdgr_encoder_t* e, const bdgr_format_t* format, void* output, int max_bytes);
+void bdgr_encode_rows(bdgr_encoder_t* e, const void* rows, int stride, int n);
+int  bdgr_encode_finish(bdgr_encoder_t* e);
+
+typedef struct bdgr_decoder_s { // all fields are private
+    bdgr_format_t f;
+    const uint8_t* input;
+    int bytes;
+    const uint8_t* above; // last row of the previous bdgr_decode_rows() call
+    int y;                // rows decoded so far
+    bdgr_reader_t reader;
+    bdgr_state_t state;
+} bdgr_decoder_t;
+
+void bdgr_decode_begin(bdgr_decoder_t* d, const void* input, int bytes, bdgr_format_t* format);
+void bdgr_decode_rows(bdgr_decoder_t* d, void* rows, int stride, int n);
+
+// bdgr_decode_region() decodes rectangle of w x h pixels at x, y into output
+// rows `stride` bytes apart and returns number of bytes written. Only stripes
+// that intersect rows [y..y + h) are decoded, and in the last one only rows
+// up to y + h. Rows of a stripe are coded full width, they are decoded into
+// `scratch` of 2 rows (2 * image width * channels * bytes per sample).
+
+int bdgr_decode_region(const void* input, int bytes, void* output, int stride,
+                       int x, int y, int w, int h, void* scratch);
+
+// Library never allocates by itself. Working memory of the calls that need
+// it is owned by bdgr_context_t created once (per thread) with caller's
+// allocator and reused for every frame: scratch only grows, release() is
+// called with the size that allocate() was asked for. bdgr_context_reserve()
+// sizes scratch for images of the format up front, after it calls on such
+// images do not allocate (and with pre-faulted pages do not page fault).
+// Functions taking context return bdgr_error_memory if allocate() fails.
+
+typedef struct bdgr_allocator_s {
+    void* (*allocate)(void* that, size_t bytes); // 8 bytes aligned or null
+    void  (*release)(void* that, void* memory, size_t bytes);
+    void* that;
+} bdgr_allocator_t;
+
+typedef struct bdgr_context_s { // all fields are private
+    bdgr_allocator_t allocator;
+    void*  scratch;
+    size_t bytes; // of scratch
+} bdgr_context_t;
+
+void bdgr_context_init(bdgr_context_t* c, const bdgr_allocator_t* allocator);
+int  bdgr_context_reserve(bdgr_context_t* c, const bdgr_format_t* format); // 0 or error
+void bdgr_context_done(bdgr_context_t* c); // releases scratch
+
+int bdgr_decode_region_ex(bdgr_context_t* c, const void* input, int bytes, void* output,
+                          int stride, int x, int y, int w, int h);
+
+// Temporal prediction: bdgr_encode_temporal() codes the difference of every
+// sample from the co-located sample of `reference` frame (same format and
+// stride, usually the previous frame) with format's spatial predictor on top
+// of it, static parts of the scene code as near zero residuals. Null reference
+// codes a keyframe. bdgr_decode_temporal() adds the same reference back in
+// the same pass, it is null only for keyframes (format.reference == 0).
+// Stored stripes keep the samples as is. Both are serial (one stripe after
+// another) and take rows of scratch from the context.
+
+int bdgr_encode_temporal(bdgr_context_t* c, const void* input, const void* reference,
+                         int stride, const bdgr_format_t* format, void* output, int max_bytes);
+int bdgr_decode_temporal(bdgr_context_t* c, const void* input, int bytes, const void* reference,
+                         void* output, int stride);
+
+// bdgr_encode_tuned() codes sampled bands of rows with a few formats that
+// differ from `format` in the fields decoder already has specialised kernels
+// for, and codes the image with the smallest one (the same format if none
+// is smaller). The choice is recorded in the stream header as usual and is
+// returned in `chosen` (may be null). bdgr_max_bytes(format) is enough: if
+// chosen stream does not fit it is coded with `format` itself.
+
+enum { // effort of bdgr_encode_tuned()
+    bdgr_effort_predictor = 1, // predictor and colour transform: decode speed of the model
+    bdgr_effort_model     = 2  // and Rice parameter model (context models decode slower)
+};
+
+int bdgr_encode_tuned(bdgr_context_t* c, const void* input, int stride,
+                      const bdgr_format_t* format, int effort, void* output, int max_bytes,
+                      bdgr_format_t* chosen);
+
+// Sequences: bdgr_encode_frame() codes every `keyframes`-th frame (and the
+// first one) as keyframe and others against the previous frame, which the
+// caller keeps intact until the next call. bdgr_decode_frame() decodes them in
+// the same order, keyframes reset it (decoding may start at any keyframe).
+
+typedef struct bdgr_sequence_s { // all fields are private
+    bdgr_context_t* context;
+    int keyframes; // interval
+    int frame;     // number of frames coded so far
+    const void* previous; // frame
+} bdgr_sequence_t;
+
+void bdgr_sequence_init(bdgr_sequence_t* q, bdgr_context_t* c, int keyframes);
+int  bdgr_encode_frame(bdgr_sequence_t* q, const void* input, int stride,
+                       const bdgr_format_t* format, void* output, int max_bytes);
+int  bdgr_decode_frame(bdgr_sequence_t* q, const void* input, int bytes, void* output, int stride);
+
+// Progressive layout: bdgr_encode_progressive() codes pixels of every 2^levels
+// column of every 2^levels row (levels 1..7) as the base layer, then for each
+// finer level l down to 0 two refinement planes: odd columns of even rows and
+// then odd rows of the level (pixel (x, y) of level l is pixel (x * 2^l,
+// y * 2^l) of the image, width and height rounded up). Refinement pixels are
+// coded as difference from the average of their known neighbours, so the
+// layers together take a few percent more than bdgr_encode() (no pixel is
+// coded twice). Stream starts with bdgr_progressive_header bytes directory:
+// bdgr_progressive_bytes() tells how long prefix of the stream decodes level l
+// (and fills w, h, channels and depth of its format), bdgr_decode_progressive()
+// decodes level l from that prefix, lossless at level 0. Levels above the
+// coarsest one give the coarsest. The decoder validates the layers it decodes
+// like bdgr_decode_checked(). Both are serial and take context scratch for
+// two planes of the largest layer (about half of the image) on top of
+// bdgr_context_reserve().
+
+enum { bdgr_progressive_levels = 7, bdgr_progressive_header = 88 };
+
+int bdgr_progressive_max_bytes(const bdgr_format_t* format, int levels);
+int bdgr_encode_progressive(bdgr_context_t* c, const void* input, int stride,
+                            const bdgr_format_t* format, int levels, void* output, int max_bytes);
+int bdgr_progressive_bytes(const void* input, int bytes, int level, bdgr_format_t* format);
+int bdgr_decode_progressive(bdgr_context_t* c, const void* input, int bytes, int level,
+                            void* output, int stride);
+
+// Batches: bdgr_encode_batch() codes n images one after another into a
+// single arena, stream of image i is at arena + images[i].offset and
+// takes images[i].bytes (both multiples of 8). Returns bytes of the arena
+// used or 0 if the streams do not fit into max_bytes. With parallel_for
+// images are coded concurrently if the arena fits all of them stored.
+// bdgr_decode_batch() decodes each of the streams into images[i].pixels
+// (packed rows), fills images[i].format and returns number of bytes written
+// or the error (bdgr_error_truncated, bdgr_error_checksum) of a failed image.
+
+typedef struct bdgr_image_s {
+    bdgr_format_t format; // encode: of the pixels, decode: read from the stream
+    void* pixels;         // encode: input, decode: output
+    int stride;           // encode: bytes between rows, 0 for packed rows
+    int offset;           // encode: output, decode: input
+    int bytes;            // encode: output, decode: input
+} bdgr_image_t;
+
+int bdgr_encode_batch(bdgr_image_t* images, int n, void* arena, int max_bytes,
+                      bdgr_parallel_for_t parallel_for, void* that);
+int bdgr_decode_batch(bdgr_image_t* images, int n, const void* arena,
+                      bdgr_parallel_for_t parallel_for, void* that);
+
+// Counters of the hot paths, compiled in only with BDGR_STATS defined (for
+// the implementation) - without it kernels have no trace of them. They count
+// what coders do on the calling thread (stripes on parallel_for workers
+// count into workers' own), caller reads and resets them.
+
+#ifdef BDGR_STATS
+
+typedef struct bdgr_stats_s {
+    int64_t codes;         // Rice codes pushed or pulled
+    int64_t escapes;       // codes with quotient q >= bdgr_cut_off
+    int64_t unary;         // sum of q + 1 bits of non escape codes
+    int64_t histogram[17]; // of Rice parameter `bits` of the codes
+    int64_t runs;          // bdgr_model_runs run codes and
+    int64_t run_pixels;    // pixels they cover
+    int64_t tails;         // decoder slow path: refills from zero padded stream tail
+    int64_t stored;        // stripes encoder stored verbatim
+} bdgr_stats_t;
+
+bdgr_stats_t* bdgr_thread_stats(void);
+
+#endif
+
 #ifdef BDGR_IMPLEMENTATION
 
 #pragma push_macro("implore")
 #pragma push_macro("swear")
 #pragma push_macro("ctz")
+#pragma push_macro("clz")
 #pragma push_macro("byte")
+#pragma push_macro("null")
 #pragma push_macro("done")
-#pragma push_macro("push_out")
-#pragma push_macro("push_bit_0")
-#pragma push_macro("push_bit_1")
 #pragma push_macro("push_bits")
-#pragma push_macro("pull_in")
-#pragma push_macro("pull_bits")
+#pragma push_macro("pull_rice")
+#pragma push_macro("rice2delta")
+#pragma push_macro("pull_delta")
+#pragma push_macro("refill")
+#pragma push_macro("push_code")
+#pragma push_macro("neighbours")
+#pragma push_macro("push_run")
+#pragma push_macro("pull_run")
+#pragma push_macro("bdgr_specialize")
+#pragma push_macro("bdgr_specialize_n")
+#pragma push_macro("bdgr_sse2")
+#pragma push_macro("bdgr_neon")
+#pragma push_macro("bdgr_avx2_target")
+#pragma push_macro("bdgr_sse42_target")
+#pragma push_macro("push_pixel")
+#pragma push_macro("push_sample")
+#pragma push_macro("pull_sample")
+#pragma push_macro("delta2rice")
+#pragma push_macro("peek64")
+#pragma push_macro("load64")
+#pragma push_macro("reader_load")
+#pragma push_macro("reader_store")
+#pragma push_macro("bdgr_count")
+#pragma push_macro("bdgr_thread_local")
 
 #define byte uint8_t
+#define null 0 // works for object and function pointers in C and C++
 
 // "supreme moral vigilance:" implore / swear https://github.com/munificent/vigil
 
@@ -133,191 +495,2801 @@ static const byte bdgr_r2d[256] = {
 
 #define done while (false)
 
-#define push_out(p, e, b64, count) do {                        \
-    count++;                                                   \
-    if (count == 64) { *p++ = b64; count = 0; swear(p <= e); } \
-} done
+// bdgr_count() adds n to the field of thread stats, nothing without BDGR_STATS
+
+#ifdef BDGR_STATS
+    #if defined(__cplusplus)
+        #define bdgr_thread_local thread_local
+    #elif defined(_MSC_VER)
+        #define bdgr_thread_local __declspec(thread)
+    #else
+        #define bdgr_thread_local _Thread_local
+    #endif
+    static bdgr_thread_local bdgr_stats_t bdgr_stats;
+    bdgr_stats_t* bdgr_thread_stats(void) { return &bdgr_stats; }
+    #define bdgr_count(field, n) (bdgr_stats.field += (n))
+#else
+    #define bdgr_count(field, n) ((void)0)
+#endif
+
+// bdgr_atomic_t is a long shared between threads with relaxed loads and
+// compare-and-swap (aligned volatile long accesses are atomic on MSVC)
+
+#ifdef _MSC_VER
+    typedef volatile long bdgr_atomic_t;
+#else
+    typedef long bdgr_atomic_t;
+#endif
+
+static inline long bdgr_atomic_load(bdgr_atomic_t* a) {
+    #ifdef _MSC_VER
+        return *a;
+    #else
+        return __atomic_load_n(a, __ATOMIC_RELAXED);
+    #endif
+}
 
-#define push_bit_0(b64) b64 >>= 1
+static inline bool bdgr_atomic_cas(bdgr_atomic_t* a, long from, long to) {
+    #ifdef _MSC_VER
+        return _InterlockedCompareExchange(a, to, from) == from;
+    #else
+        return __atomic_compare_exchange_n(a, &from, to, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+    #endif
+}
+
+// bdgr_once() runs processor feature detect() on the first call only and
+// keeps its result in `flag` (0 unknown, 1 absent, 2 present); racing first
+// calls store the same value
+
+static inline bool bdgr_once(bdgr_atomic_t* flag, bool (*detect)(void)) {
+    long v = bdgr_atomic_load(flag);
+    if (v == 0) {
+        v = detect() ? 2 : 1;
+        bdgr_atomic_cas(flag, 0, v);
+    }
+    return v == 2;
+}
 
-#define push_bit_1(b64) b64 = (1ULL << 63) | (b64 >> 1)
+// push_bits() appends `bits` low bits of `val` to the stream in one go.
+// Stream is little endian and "least significant bit first": the n-th bit of
+// the stream is bit (n % 64) of the word [n / 64]. b64 accumulates `count`
+// pending bits at the bottom and is flushed only on a full 64 bit word.
+// bits must be in [1..32] (bits < 64 is what keeps shifts well defined)
+// Output bound `e` is only checked on flush. Word that does not fit is dropped
+// and e is moved to p - 1 so that p > e tells the caller about overflow.
 
-#define push_bits(p, e, b64, count, val, bits) do {               \
-    int v = val;                                                  \
-    for (int i = 0; i < bits; i++) {                              \
-        if (v & 1) { push_bit_1(b64); } else { push_bit_0(b64); } \
-        push_out(p, e, b64, count);                               \
-        v >>= 1;                                                  \
-    }                                                             \
+#define push_bits(p, e, b64, count, val, bits) do {             \
+    const uint64_t v64 = (uint64_t)(val);                       \
+    b64 |= v64 << count;                                        \
+    count += (bits);                                            \
+    if (count >= 64) {                                          \
+        if (p < e) { *p++ = b64; } else { e = p - 1; }          \
+        count -= 64;                                            \
+        b64 = v64 >> ((bits) - count); /* leftover high bits */ \
+    }                                                           \
 } done
 
 #ifndef _MSC_VER // using compiler identification instead of WIN32
     #define ctz(x) __builtin_ctz(x) // __builtin_ctz(0) is undefined!
+    #define clz(x) __builtin_clz(x) // __builtin_clz(0) is undefined!
+    #define bdgr_inline inline __attribute__((always_inline))
     #define prefetch(p) __builtin_prefetch(p, 0, 3) // https://gcc.gnu.org/onlinedocs/gcc/Other-Builtins.html
+    static inline uint64_t load64(const byte* a) { uint64_t v; __builtin_memcpy(&v, a, 8); return v; }
 #else // Microsoft Windows version __builtin_ctz
     static uint32_t __forceinline ctz(uint32_t x) {
         unsigned long r = 0; implore(x != 0); _BitScanForward(&r, (unsigned long)x); return r;
     }
+    #define bdgr_inline __forceinline
+    static uint32_t __forceinline clz(uint32_t x) {
+        unsigned long r = 0; implore(x != 0); _BitScanReverse(&r, (unsigned long)x); return 31 - r;
+    }
     // imperically: _MM_HINT_T2 is about 3% faster then _MM_HINT_NTA, _MM_HINT_T0 and _MM_HINT_T1
     #define prefetch(p) _mm_prefetch((const char*)p, _MM_HINT_T2) // retain in all caches
+    #define load64(a) (*(const uint64_t __unaligned*)(a)) // unaligned little endian load
 #endif
 
-int bdgr_encode(const void* data, int w, int h, void* output, int max_bytes) {
-    implore(max_bytes % 8 == 0);
-    const uint64_t* end = (uint64_t*)((byte*)output + max_bytes);
-    uint64_t b64 = 0;
-    int count = 0;
-    uint64_t* p = (uint64_t*)output;
-    // shared knowledge between encoder and decoder:
-    // does not have to be encoded in the stream, may as well be simply known by both
-    push_bits(p, end, b64, count, w, 16);
-    push_bits(p, end, b64, count, h, 16);
-    int bits = bdgr_start_with_bits;
-    byte prediction = 0;
-    const byte* s = (byte*)data;
-    const byte* e = s + w * h;
-    while (s < e) {
-        byte px = *s++;
-        int delta = px - prediction;
-        swear((byte)(prediction + delta) == px);
-        #ifdef BDGR_NO_TABLES
-            delta = delta < 0 ? delta + 256 : delta;
-            delta = delta >= 128 ? delta - 256 : delta;
-            // this folds abs(deltas) > 128 to much smaller numbers which is OK
-            swear(-128 <= delta && delta <= 127);
-            // delta:    -128 ... -2, -1, 0, +1, +2 ... + 127
-            // positive:                  0,  2,  4       254
-            // negative:  255      3   1
-            int rice = delta >= 0 ? delta * 2 : -delta * 2 - 1;
-            swear(0 <= rice && rice <= 0xFF);
-        #else
-            byte rice = bdgr_d2r[delta + 255];
-        #endif
-        const int m = 1 << bits;
-        int q = rice >> bits; // rice / m quotient
-        if (q < bdgr_cut_off) {
-            while (q > 0) { push_bit_0(b64); push_out(p, end, b64, count); q--; }
-            push_bit_1(b64); push_out(p, end, b64, count);
-            const int r = rice & (m - 1); // v % m reminder (bits)
-            push_bits(p, end, b64, count, r, bits);
-        } else {
-            q = bdgr_cut_off;
-            while (q > 0) { push_bit_0(b64); push_out(p, end, b64, count); q--; }
-            push_bit_1(b64); push_out(p, end, b64, count);
-            push_bits(p, end, b64, count, rice, 8);
+#ifdef BDGR_NO_TABLES
+    static inline int bdgr_delta2rice(int delta) {
+        delta = delta < 0 ? delta + 256 : delta;
+        delta = delta >= 128 ? delta - 256 : delta;
+        // this folds abs(deltas) > 128 to much smaller numbers which is OK
+        swear(-128 <= delta && delta <= 127);
+        // delta:    -128 ... -2, -1, 0, +1, +2 ... + 127
+        // positive:                  0,  2,  4       254
+        // negative:  255      3   1
+        int rice = delta >= 0 ? delta * 2 : -delta * 2 - 1;
+        swear(0 <= rice && rice <= 0xFF);
+        return rice;
+    }
+    #define delta2rice(delta) bdgr_delta2rice(delta)
+    #define rice2delta(rice) (byte)(rice % 2 == 0 ? rice / 2 : -(rice / 2) - 1)
+#else
+    #define delta2rice(delta) bdgr_d2r[(delta) + 255]
+    #define rice2delta(rice) bdgr_r2d[rice]
+#endif
+
+// median edge detector: a - left, b - above, c - upper-left
+// med(a, b, c) = median(a, b, a + b - c) = clamp(a + b - c, min(a, b), max(a, b))
+// written as min/max so it compiles to cmovs instead of unpredictable branches
+
+static inline int bdgr_med(int a, int b, int c) {
+    const int mx = a > b ? a : b;
+    const int mn = a < b ? a : b;
+    const int g  = a + b - c; // gradient
+    const int lo = g < mx ? g : mx;
+    return lo > mn ? lo : mn;
+}
+
+// bdgr_rct() loads n channels of the pixel and applies colour transform
+
+static inline void bdgr_rct(const byte* s, int n, int transform, byte* px) {
+    for (int c = 0; c < n; c++) { px[c] = s[c]; }
+    if (transform == bdgr_transform_rct && n >= 3) {
+        px[0] = (byte)(px[0] - px[1]);
+        px[2] = (byte)(px[2] - px[1]);
+    }
+}
+
+static inline void bdgr_rct_inverse(const byte* px, int n, int transform, byte* d) {
+    for (int c = 0; c < n; c++) { d[c] = px[c]; }
+    if (transform == bdgr_transform_rct && n >= 3) {
+        d[0] = (byte)(px[0] + px[1]);
+        d[2] = (byte)(px[2] + px[1]);
+    }
+}
+
+// High bit depth (9..16 bits per sample) counterparts. All arithmetic is
+// modulo 1 << depth and `mask` is (1 << depth) - 1.
+
+static inline void bdgr_rct16(const uint16_t* s, int n, int transform, int mask, int* px) {
+    for (int c = 0; c < n; c++) { px[c] = s[c]; implore(s[c] <= mask); }
+    if (transform == bdgr_transform_rct && n >= 3) {
+        px[0] = (px[0] - px[1]) & mask;
+        px[2] = (px[2] - px[1]) & mask;
+    }
+}
+
+static inline void bdgr_rct16_inverse(const int* px, int n, int transform, int mask, uint16_t* d) {
+    for (int c = 0; c < n; c++) { d[c] = (uint16_t)px[c]; }
+    if (transform == bdgr_transform_rct && n >= 3) {
+        d[0] = (uint16_t)((px[0] + px[1]) & mask);
+        d[2] = (uint16_t)((px[2] + px[1]) & mask);
+    }
+}
+
+// bdgr_fold() is bdgr_d2r[] for any depth: delta modulo 1 << depth folded
+// into [-(1 << (depth - 1))..(1 << (depth - 1)) - 1] and zigzag mapped.
+
+static inline int bdgr_fold(int delta, int depth) {
+    const int shift = 32 - depth; // sign extend low `depth` bits of delta
+    const int32_t folded = (int32_t)((uint32_t)delta << shift) >> shift;
+    return (int)(((uint32_t)folded << 1) ^ (uint32_t)(folded >> 31)); // zigzag
+}
+
+static inline int bdgr_unfold(int rice) { return (rice >> 1) ^ -(rice & 1); }
+
+// bdgr_k4rice16() is bdgr_k4rice[] for any rice value computed with clz:
+// ceil(log2(rice)) and "imperical" decrement for bits > 1
+
+static inline int bdgr_k4rice16(int rice) {
+    const int bits = rice > 1 ? 32 - (int)clz((uint32_t)rice - 1) : 0;
+    return bits > 1 ? bits - 1 : bits;
+}
+
+// push_code() appends Golomb-Rice code of `rice` with parameter `bits`
+
+#define push_code(p, e, b64, count, rice, bits, depth) do {                           \
+    const int q_ = (rice) >> (bits); /* rice / m quotient */                          \
+    bdgr_count(codes, 1);                                                             \
+    bdgr_count(histogram[(bits)], 1);                                                 \
+    bdgr_count(escapes, q_ >= bdgr_cut_off);                                          \
+    bdgr_count(unary, q_ < bdgr_cut_off ? q_ + 1 : 0);                                \
+    /* whole code: q zero bits, stop bit 1, then remainder - all in one push */       \
+    if (q_ < bdgr_cut_off) {                                                          \
+        const uint32_t r_ = (rice) & ((1 << (bits)) - 1); /* v % m reminder */        \
+        push_bits(p, e, b64, count, ((r_ << 1) | 1) << q_, q_ + 1 + (bits));          \
+    } else { /* escape: bdgr_cut_off zero bits, stop bit and `depth` bits of rice */  \
+        push_bits(p, e, b64, count, (((uint32_t)(rice) << 1) | 1) << bdgr_cut_off,    \
+                  bdgr_cut_off + 1 + (depth));                                        \
+    }                                                                                 \
+} done
+
+// push_pixel() codes px against prediction and adapts Rice parameter `bits`
+
+#define push_pixel(p, e, b64, count, px, prediction, bits) do {                       \
+    const int rice_ = delta2rice((int)(px) - (int)(prediction));                      \
+    push_code(p, e, b64, count, rice_, bits, 8);                                      \
+    bits = bdgr_k4rice[rice_];                                                        \
+} done
+
+// Coding state of a stripe is carried from row to row in bdgr_state_t so that
+// kernels below can be called for any number of rows at a time (streaming).
+// `above` is the row before the first one passed or null at the stripe start.
+
+enum { // bdgr_model_context counters
+    bdgr_contexts = 20,     // logarithmic buckets of local activity (see bdgr_context())
+    bdgr_context_reset = 64 // sum and codes are halved when codes reaches it
+};
+
+static void bdgr_state_init(bdgr_state_t* st) {
+    st->b64 = 0;
+    st->count = 0;
+    st->run = 0;
+    for (int i = 0; i < 4; i++) {
+        st->bits[i] = bdgr_start_with_bits;
+        st->a[i] = 0;
+        for (int j = 0; j < bdgr_contexts; j++) {
+            st->sum[i][j] = 4; // JPEG-LS initial A for 8 bits, adapts fast for more
+            st->codes[i][j] = 1;
         }
-        bits = bdgr_k4rice[rice];
-        prediction = px;
     }
-    if (count > 0) { // flush last bits
-        b64 >>= (64 - count);
-        *p++ = b64;
+}
+
+// kernels below return null if output overflows, bdgr_flush() passes null through
+
+static uint64_t* bdgr_flush(bdgr_state_t* st, uint64_t* p, const uint64_t* end) {
+    if (p != null && st->count > 0) { // flush last bits (already at the bottom)
+        if (p < end) { *p++ = st->b64; } else { p = null; }
     }
-    (void)end; // for the performance reasons max_bytes is NOT checked in release build
-    return (int)((byte*)p - (byte*)output); // in 64 bits increments
+    st->b64 = 0;
+    st->count = 0;
+    return p;
 }
 
-#define pull_in(p, b64, count) do {             \
-    if (count == 0) {                           \
-        b64 = *p++;                             \
-        count = 64;                             \
-        prefetch(p);                            \
-    }                                           \
+// Interleaved kernels are bdgr_inline functions instantiated by bdgr_specialize()
+// once per format with compile time constant channels, transform and predictor
+// so that per sample loops and branches of features a format does not use fold away.
+// `kernel(n, transform, predictor)` is a macro that calls the kernel and returns.
+// Transform is only ever applied to 3 and 4 channels (see bdgr_check_format()).
+
+#define bdgr_specialize(kernel, n, transform, predictor) do {                 \
+    if (predictor == bdgr_predictor_left) {                                   \
+        bdgr_specialize_n(kernel, n, transform, bdgr_predictor_left);         \
+    } else {                                                                  \
+        bdgr_specialize_n(kernel, n, transform, bdgr_predictor_med);          \
+    }                                                                         \
 } done
 
-#define pull_bits(v, p, b64, count, bits) do {  \
-    if (count >= bits) {                        \
-        v = (uint32_t)b64 & ((1U << bits) - 1); \
-        b64 >>= bits;                           \
-        count -= bits;                          \
-    } else {                                    \
-        v = 0;                                  \
-        int mask = 1;                           \
-        for (int i = 0; i < bits; i++) {        \
-            implore(count > 0);                 \
-            if ((int)b64 & 1) { v |= mask; }    \
-            mask <<= 1;                         \
-            b64 >>= 1;                          \
-            count--;                            \
-            pull_in(p, b64, count);             \
-        }                                       \
-    }                                           \
+#define bdgr_specialize_n(kernel, n, transform, predictor) do {               \
+    const bool rct_ = transform == bdgr_transform_rct;                        \
+    if (n == 1) { kernel(1, bdgr_transform_none, predictor); }                \
+    if (n == 3 && !rct_) { kernel(3, bdgr_transform_none, predictor); }       \
+    if (n == 3) { kernel(3, bdgr_transform_rct, predictor); }                 \
+    if (n == 4 && !rct_) { kernel(4, bdgr_transform_none, predictor); }       \
+    if (n == 4) { kernel(4, bdgr_transform_rct, predictor); }                 \
+    implore(n == 2 && !rct_);                                                 \
+    kernel(2, bdgr_transform_none, predictor);                                \
 } done
 
-int bdgr_decode(const void* input, int bytes, void* output, int width, int height) {
-    implore(bytes % 8 == 0); (void)bytes;
-    uint64_t* p = (uint64_t*)input;
-    uint64_t b64 = 0;
-    int count = 0; // number of valid bits in b64
-    int bits  = bdgr_start_with_bits;
-    pull_in(p, b64, count); // pull in first 64 bits
-    int w; pull_bits(w, p, b64, count, 16);
-    int h; pull_bits(h, p, b64, count, 16);
-    implore(w == width && h == height); (void)width; (void)height;
-    byte* d = (byte*)output;
-    byte* end = d + w * h;
-    byte prediction = 0;
-    while (d < end) {
-        int q = 0;
-        pull_in(p, b64, count);
-        if (count > bdgr_cut_off) {
-            implore((uint32_t)b64 != 0);
-            q = ctz((uint32_t)b64);
-            b64  >>= (q + 1);
-            count -= (q + 1);
-            pull_in(p, b64, count); // pull in next bits if necessary
-        } else { // not enough bits in b64, do it one by one
-            for (;;) {
-                implore(count > 0);
-                int bit = (int)b64 & 1;
-                b64 >>= 1;
-                count--;
-                pull_in(p, b64, count);
-                if (bit == 1) { break; }
-                q++;
+// 8 bit pixels are coded in two stages. First one computes rice (zigzag mapped
+// residual) of a chunk of the row from the pixels alone and the Rice parameter
+// the next pixel gets: k4[i] = bdgr_k4rice[rice[i]]. Second one only packs
+// codes, so the first is free to do 16 or 32 pixels at a time. Both stages
+// start at x0 >= 1: `up` is the row above for MED and null for left predictor.
+
+enum { bdgr_chunk = 256 }; // pixels per stage
+
+typedef void (*bdgr_residuals_t)(const byte* s, const byte* up, int x0, int x1,
+                                 byte* rice, byte* k4);
+
+static void bdgr_residuals(const byte* s, const byte* up, int x0, int x1,
+        byte* rice, byte* k4) {
+    for (int x = x0; x < x1; x++) {
+        const int prediction = up == null ? s[x - 1] : bdgr_med(s[x - 1], up[x], up[x - 1]);
+        const int r = delta2rice(s[x] - prediction);
+        rice[x - x0] = (byte)r;
+        k4[x - x0] = (byte)bdgr_k4rice[r];
+    }
+}
+
+// Vector stages use med(a, b, c) = c >= max(a, b) ? min(a, b) : c <= min(a, b) ?
+// max(a, b) : a + b - c (which is exact modulo 256 in that range), zigzag
+// rice = (d + d) ^ (d < 0 ? 0xFF : 0) of signed byte residual d and
+// bdgr_k4rice[r] = number of {1, 4, 8, 16, 32, 64, 128} that are below r.
+
+#if defined(BDGR_NO_SIMD) // scalar stage only
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+    #define bdgr_sse2
+#elif defined(__ARM_NEON) || defined(_M_ARM64)
+    #define bdgr_neon
+#endif
+
+#ifdef bdgr_sse2
+
+static void bdgr_residuals_sse2(const byte* s, const byte* up, int x0, int x1,
+        byte* rice, byte* k4) {
+    const __m128i zero = _mm_setzero_si128();
+    int x = x0;
+    for (; x + 16 <= x1; x += 16) {
+        const __m128i a = _mm_loadu_si128((const __m128i*)(s + x - 1));
+        __m128i prediction = a;
+        if (up != null) {
+            const __m128i b = _mm_loadu_si128((const __m128i*)(up + x));
+            const __m128i c = _mm_loadu_si128((const __m128i*)(up + x - 1));
+            const __m128i mx = _mm_max_epu8(a, b);
+            const __m128i mn = _mm_min_epu8(a, b);
+            const __m128i ge = _mm_cmpeq_epi8(_mm_max_epu8(c, mx), c); // c >= mx
+            const __m128i le = _mm_cmpeq_epi8(_mm_min_epu8(c, mn), c); // c <= mn
+            const __m128i g = _mm_sub_epi8(_mm_add_epi8(a, b), c);
+            prediction = _mm_or_si128(_mm_and_si128(le, mx), _mm_andnot_si128(le, g));
+            prediction = _mm_or_si128(_mm_and_si128(ge, mn), _mm_andnot_si128(ge, prediction));
+        }
+        const __m128i d = _mm_sub_epi8(_mm_loadu_si128((const __m128i*)(s + x)), prediction);
+        const __m128i r = _mm_xor_si128(_mm_add_epi8(d, d), _mm_cmpgt_epi8(zero, d));
+        __m128i k = _mm_set1_epi8(7); // minus one for each threshold r <= t
+        k = _mm_add_epi8(k, _mm_cmpeq_epi8(_mm_subs_epu8(r, _mm_set1_epi8(1)), zero));
+        k = _mm_add_epi8(k, _mm_cmpeq_epi8(_mm_subs_epu8(r, _mm_set1_epi8(4)), zero));
+        k = _mm_add_epi8(k, _mm_cmpeq_epi8(_mm_subs_epu8(r, _mm_set1_epi8(8)), zero));
+        k = _mm_add_epi8(k, _mm_cmpeq_epi8(_mm_subs_epu8(r, _mm_set1_epi8(16)), zero));
+        k = _mm_add_epi8(k, _mm_cmpeq_epi8(_mm_subs_epu8(r, _mm_set1_epi8(32)), zero));
+        k = _mm_add_epi8(k, _mm_cmpeq_epi8(_mm_subs_epu8(r, _mm_set1_epi8(64)), zero));
+        k = _mm_add_epi8(k, _mm_cmpeq_epi8(_mm_subs_epu8(r, _mm_set1_epi8((char)128)), zero));
+        _mm_storeu_si128((__m128i*)(rice + x - x0), r);
+        _mm_storeu_si128((__m128i*)(k4 + x - x0), k);
+    }
+    bdgr_residuals(s, up, x, x1, rice + x - x0, k4 + x - x0);
+}
+
+#ifdef _MSC_VER
+    #define bdgr_avx2_target
+#else
+    #define bdgr_avx2_target __attribute__((target("avx2")))
+#endif
+
+bdgr_avx2_target
+static void bdgr_residuals_avx2(const byte* s, const byte* up, int x0, int x1,
+        byte* rice, byte* k4) {
+    const __m256i zero = _mm256_setzero_si256();
+    int x = x0;
+    for (; x + 32 <= x1; x += 32) {
+        const __m256i a = _mm256_loadu_si256((const __m256i*)(s + x - 1));
+        __m256i prediction = a;
+        if (up != null) {
+            const __m256i b = _mm256_loadu_si256((const __m256i*)(up + x));
+            const __m256i c = _mm256_loadu_si256((const __m256i*)(up + x - 1));
+            const __m256i mx = _mm256_max_epu8(a, b);
+            const __m256i mn = _mm256_min_epu8(a, b);
+            const __m256i ge = _mm256_cmpeq_epi8(_mm256_max_epu8(c, mx), c);
+            const __m256i le = _mm256_cmpeq_epi8(_mm256_min_epu8(c, mn), c);
+            const __m256i g = _mm256_sub_epi8(_mm256_add_epi8(a, b), c);
+            prediction = _mm256_blendv_epi8(_mm256_blendv_epi8(g, mx, le), mn, ge);
+        }
+        const __m256i d = _mm256_sub_epi8(_mm256_loadu_si256((const __m256i*)(s + x)), prediction);
+        const __m256i r = _mm256_xor_si256(_mm256_add_epi8(d, d), _mm256_cmpgt_epi8(zero, d));
+        __m256i k = _mm256_set1_epi8(7);
+        k = _mm256_add_epi8(k, _mm256_cmpeq_epi8(_mm256_subs_epu8(r, _mm256_set1_epi8(1)), zero));
+        k = _mm256_add_epi8(k, _mm256_cmpeq_epi8(_mm256_subs_epu8(r, _mm256_set1_epi8(4)), zero));
+        k = _mm256_add_epi8(k, _mm256_cmpeq_epi8(_mm256_subs_epu8(r, _mm256_set1_epi8(8)), zero));
+        k = _mm256_add_epi8(k, _mm256_cmpeq_epi8(_mm256_subs_epu8(r, _mm256_set1_epi8(16)), zero));
+        k = _mm256_add_epi8(k, _mm256_cmpeq_epi8(_mm256_subs_epu8(r, _mm256_set1_epi8(32)), zero));
+        k = _mm256_add_epi8(k, _mm256_cmpeq_epi8(_mm256_subs_epu8(r, _mm256_set1_epi8(64)), zero));
+        k = _mm256_add_epi8(k, _mm256_cmpeq_epi8(_mm256_subs_epu8(r, _mm256_set1_epi8((char)128)), zero));
+        _mm256_storeu_si256((__m256i*)(rice + x - x0), r);
+        _mm256_storeu_si256((__m256i*)(k4 + x - x0), k);
+    }
+    bdgr_residuals_sse2(s, up, x, x1, rice + x - x0, k4 + x - x0);
+}
+
+static bool bdgr_detect_avx2(void) {
+    #ifdef _MSC_VER
+        int info[4];
+        __cpuid(info, 1);
+        const bool osxsave = (info[2] & (1 << 27)) != 0;
+        if (!osxsave || (_xgetbv(0) & 6) != 6) { return false; } // OS saves ymm registers
+        __cpuidex(info, 7, 0);
+        return (info[1] & (1 << 5)) != 0;
+    #else
+        return __builtin_cpu_supports("avx2");
+    #endif
+}
+
+static bool bdgr_has_avx2(void) { // __cpuid and _xgetbv serialize, detect once
+    static bdgr_atomic_t avx2;
+    return bdgr_once(&avx2, bdgr_detect_avx2);
+}
+
+#endif // bdgr_sse2
+
+#ifdef bdgr_neon
+
+static void bdgr_residuals_neon(const byte* s, const byte* up, int x0, int x1,
+        byte* rice, byte* k4) {
+    static const byte thresholds[7] = { 1, 4, 8, 16, 32, 64, 128 };
+    int x = x0;
+    for (; x + 16 <= x1; x += 16) {
+        const uint8x16_t a = vld1q_u8(s + x - 1);
+        uint8x16_t prediction = a;
+        if (up != null) {
+            const uint8x16_t b = vld1q_u8(up + x);
+            const uint8x16_t c = vld1q_u8(up + x - 1);
+            const uint8x16_t mx = vmaxq_u8(a, b);
+            const uint8x16_t mn = vminq_u8(a, b);
+            const uint8x16_t g = vsubq_u8(vaddq_u8(a, b), c);
+            prediction = vbslq_u8(vcgeq_u8(c, mx), mn, vbslq_u8(vcleq_u8(c, mn), mx, g));
+        }
+        const int8x16_t d = vreinterpretq_s8_u8(vsubq_u8(vld1q_u8(s + x), prediction));
+        const uint8x16_t r = vreinterpretq_u8_s8(veorq_s8(vshlq_n_s8(d, 1), vshrq_n_s8(d, 7)));
+        uint8x16_t k = vdupq_n_u8(0);
+        for (int i = 0; i < 7; i++) { k = vsubq_u8(k, vcgtq_u8(r, vdupq_n_u8(thresholds[i]))); }
+        vst1q_u8(rice + x - x0, r);
+        vst1q_u8(k4 + x - x0, k);
+    }
+    bdgr_residuals(s, up, x, x1, rice + x - x0, k4 + x - x0);
+}
+
+#endif // bdgr_neon
+
+// bdgr_residuals_fn() picks the widest residual stage the processor has
+// (detected on the first call)
+
+static bdgr_residuals_t bdgr_residuals_fn(void) {
+    #if defined(bdgr_sse2)
+        return bdgr_has_avx2() ? bdgr_residuals_avx2 : bdgr_residuals_sse2;
+    #elif defined(bdgr_neon)
+        return bdgr_residuals_neon;
+    #else
+        return bdgr_residuals;
+    #endif
+}
+
+// CRC32C (Castagnoli, reflected 0x82F63B78) of stripe samples. Functions
+// take and return the register, bdgr_checksum() inverts it at both ends.
+
+typedef uint32_t (*bdgr_crc32c_t)(uint32_t crc, const byte* s, size_t n);
+
+static uint32_t bdgr_crc32c(uint32_t crc, const byte* s, size_t n) { // 4 bits at a time
+    static const uint32_t nibble[16] = {
+        0x00000000, 0x105EC76F, 0x20BD8EDE, 0x30E349B1, 0x417B1DBC, 0x5125DAD3, 0x61C69362, 0x7198540D,
+        0x82F63B78, 0x92A8FC17, 0xA24BB5A6, 0xB21572C9, 0xC38D26C4, 0xD3D3E1AB, 0xE330A81A, 0xF36E6F75
+    };
+    for (size_t i = 0; i < n; i++) {
+        crc ^= s[i];
+        crc = (crc >> 4) ^ nibble[crc & 0xF];
+        crc = (crc >> 4) ^ nibble[crc & 0xF];
+    }
+    return crc;
+}
+
+#if defined(bdgr_sse2) && (defined(__x86_64__) || defined(_M_X64))
+
+#ifdef _MSC_VER
+    #define bdgr_sse42_target
+#else
+    #define bdgr_sse42_target __attribute__((target("sse4.2")))
+#endif
+
+bdgr_sse42_target
+static uint32_t bdgr_crc32c_sse42(uint32_t crc, const byte* s, size_t n) {
+    size_t i = 0;
+    uint64_t c = crc;
+    for (; i + 8 <= n; i += 8) { c = _mm_crc32_u64(c, load64(s + i)); }
+    crc = (uint32_t)c;
+    for (; i < n; i++) { crc = _mm_crc32_u8(crc, s[i]); }
+    return crc;
+}
+
+static bool bdgr_detect_sse42(void) {
+    #ifdef _MSC_VER
+        int info[4];
+        __cpuid(info, 1);
+        return (info[2] & (1 << 20)) != 0;
+    #else
+        return __builtin_cpu_supports("sse4.2");
+    #endif
+}
+
+static bool bdgr_has_sse42(void) { // per stripe and per streamed rows call, detect once
+    static bdgr_atomic_t sse42;
+    return bdgr_once(&sse42, bdgr_detect_sse42);
+}
+
+#elif defined(bdgr_neon) && defined(__ARM_FEATURE_CRC32)
+
+static uint32_t bdgr_crc32c_arm(uint32_t crc, const byte* s, size_t n) {
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) { crc = __crc32cd(crc, load64(s + i)); }
+    for (; i < n; i++) { crc = __crc32cb(crc, s[i]); }
+    return crc;
+}
+
+#endif
+
+static bdgr_crc32c_t bdgr_crc32c_fn(void) {
+    #if defined(bdgr_sse2) && (defined(__x86_64__) || defined(_M_X64))
+        return bdgr_has_sse42() ? bdgr_crc32c_sse42 : bdgr_crc32c;
+    #elif defined(bdgr_neon) && defined(__ARM_FEATURE_CRC32)
+        return bdgr_crc32c_arm;
+    #else
+        return bdgr_crc32c;
+    #endif
+}
+
+static uint32_t bdgr_checksum(bdgr_crc32c_t crc32c, uint32_t crc, const byte* s, int stride,
+        int row, int rows) {
+    for (int y = 0; y < rows; y++) { crc = crc32c(crc, s + (size_t)y * stride, row); }
+    return crc;
+}
+
+// bdgr_encode_pixels() codes h rows of w packed pixels
+
+static uint64_t* bdgr_encode_pixels(const byte* s, const byte* above, int w, int h,
+        int predictor, bdgr_state_t* st, uint64_t* p, const uint64_t* end) {
+    implore(predictor == bdgr_predictor_left || predictor == bdgr_predictor_med);
+    const bdgr_residuals_t residuals = bdgr_residuals_fn();
+    byte rice[bdgr_chunk];
+    byte k4[bdgr_chunk];
+    uint64_t b64 = st->b64;
+    int count = st->count;
+    int bits = st->bits[0];
+    byte prediction = (byte)st->a[0];
+    for (int y = 0; y < h && p <= end; y++) { // bail out on overflow
+        const byte* up = predictor == bdgr_predictor_med ? above : null; // first row: left
+        push_pixel(p, end, b64, count, s[0], up == null ? prediction : up[0], bits);
+        for (int x0 = 1; x0 < w; x0 += bdgr_chunk) {
+            const int n = w - x0 < bdgr_chunk ? w - x0 : bdgr_chunk;
+            residuals(s, up, x0, x0 + n, rice, k4);
+            for (int i = 0; i < n; i++) {
+                push_code(p, end, b64, count, rice[i], bits, 8);
+                bits = k4[i];
+            }
+        }
+        prediction = s[w - 1];
+        above = s;
+        s += w;
+    }
+    st->b64 = b64;
+    st->count = count;
+    st->bits[0] = bits;
+    st->a[0] = prediction;
+    return p <= end ? p : null;
+}
+
+// bdgr_encode_channels() is bdgr_encode_pixels() for interleaved channels
+// and/or rows `stride` bytes apart. Each channel has its own prediction and
+// Rice parameter and codes of all channels of a pixel follow each other.
+
+static bdgr_inline uint64_t* bdgr_encode_channels(const byte* s, int stride, const byte* above,
+        int w, int h,  int n, int transform, int predictor, bdgr_state_t* st,
+        uint64_t* p, const uint64_t* end) {
+    implore(1 <= n && n <= 4);
+    uint64_t b64 = st->b64;
+    int count = st->count;
+    int  bits[4];
+    byte a[4]; // left (previous in scan order for bdgr_predictor_left)
+    byte b[4]; // above
+    byte c[4]; // upper-left
+    byte px[4];
+    for (int i = 0; i < 4; i++) { bits[i] = st->bits[i]; a[i] = (byte)st->a[i]; }
+    for (int y = 0; y < h && p <= end; y++) { // bail out on overflow
+        const byte* row = s + (size_t)y * stride;
+        if (predictor == bdgr_predictor_left || above == null) {
+            for (int x = 0; x < w; x++) {
+                bdgr_rct(row + x * n, n, transform, px);
+                for (int i = 0; i < n; i++) {
+                    push_pixel(p, end, b64, count, px[i], a[i], bits[i]);
+                    a[i] = px[i];
+                }
+            }
+        } else {
+            implore(predictor == bdgr_predictor_med);
+            bdgr_rct(above, n, transform, b);
+            bdgr_rct(row, n, transform, px);
+            for (int i = 0; i < n; i++) { // first column: above
+                push_pixel(p, end, b64, count, px[i], b[i], bits[i]);
+                a[i] = px[i];
+                c[i] = b[i];
+            }
+            for (int x = 1; x < w; x++) {
+                bdgr_rct(above + x * n, n, transform, b);
+                bdgr_rct(row + x * n, n, transform, px);
+                for (int i = 0; i < n; i++) {
+                    push_pixel(p, end, b64, count, px[i], (byte)bdgr_med(a[i], b[i], c[i]), bits[i]);
+                    a[i] = px[i];
+                    c[i] = b[i];
+                }
             }
         }
-        int rice;
-        if (q < bdgr_cut_off) {
-            int r;
-            pull_bits(r, p, b64, count, bits);
-            rice = (q << bits) | r;
+        above = row;
+    }
+    st->b64 = b64;
+    st->count = count;
+    for (int i = 0; i < 4; i++) { st->bits[i] = bits[i]; st->a[i] = a[i]; }
+    return p <= end ? p : null;
+}
+
+static uint64_t* bdgr_encode_bytes(const byte* s, int stride, const byte* above,
+        int w, int h, int n, int transform, int predictor, bdgr_state_t* st,
+        uint64_t* p, const uint64_t* end) {
+    #define bdgr_encode_channels_n(n, transform, predictor) \
+        return bdgr_encode_channels(s, stride, above, w, h, n, transform, predictor, st, p, end)
+    bdgr_specialize(bdgr_encode_channels_n, n, transform, predictor);
+    #undef bdgr_encode_channels_n
+}
+
+// push_sample() is push_pixel() for depth > 8 bits where escape carries all
+// `depth` bits of rice. Longest code is bdgr_cut_off + 1 + 16 = 28 bits.
+
+#define push_sample(p, e, b64, count, px, prediction, bits, depth) do {               \
+    const int rice_ = bdgr_fold((px) - (prediction), depth);                          \
+    push_code(p, e, b64, count, rice_, bits, depth);                                  \
+    bits = bdgr_k4rice16(rice_);                                                      \
+} done
+
+// bdgr_encode_samples() is bdgr_encode_channels() for uint16_t samples.
+
+static bdgr_inline uint64_t* bdgr_encode_samples(const byte* s, int stride, const byte* up,
+        int w, int h, int n, int transform, int predictor, int depth, bdgr_state_t* st,
+        uint64_t* p, const uint64_t* end) {
+    implore(1 <= n && n <= 4 && 8 < depth && depth <= 16);
+    const int mask = (1 << depth) - 1;
+    uint64_t b64 = st->b64;
+    int count = st->count;
+    int bits[4];
+    int a[4]; // left (previous in scan order for bdgr_predictor_left)
+    int b[4]; // above
+    int c[4]; // upper-left
+    int px[4];
+    for (int i = 0; i < 4; i++) { bits[i] = st->bits[i]; a[i] = st->a[i]; }
+    for (int y = 0; y < h && p <= end; y++) { // bail out on overflow
+        const uint16_t* row = (const uint16_t*)(s + (size_t)y * stride);
+        if (predictor == bdgr_predictor_left || up == null) {
+            for (int x = 0; x < w; x++) {
+                bdgr_rct16(row + x * n, n, transform, mask, px);
+                for (int i = 0; i < n; i++) {
+                    push_sample(p, end, b64, count, px[i], a[i], bits[i], depth);
+                    a[i] = px[i];
+                }
+            }
         } else {
-            pull_bits(rice, p, b64, count, 8);
+            implore(predictor == bdgr_predictor_med);
+            const uint16_t* above = (const uint16_t*)up;
+            bdgr_rct16(above, n, transform, mask, b);
+            bdgr_rct16(row, n, transform, mask, px);
+            for (int i = 0; i < n; i++) { // first column: above
+                push_sample(p, end, b64, count, px[i], b[i], bits[i], depth);
+                a[i] = px[i];
+                c[i] = b[i];
+            }
+            for (int x = 1; x < w; x++) {
+                bdgr_rct16(above + x * n, n, transform, mask, b);
+                bdgr_rct16(row + x * n, n, transform, mask, px);
+                for (int i = 0; i < n; i++) {
+                    push_sample(p, end, b64, count, px[i], bdgr_med(a[i], b[i], c[i]),
+                                bits[i], depth);
+                    a[i] = px[i];
+                    c[i] = b[i];
+                }
+            }
         }
-        swear(0 <= rice && rice <= 0xFF);
-        #ifdef BDGR_NO_TABLES
-            int delta = rice % 2 == 0 ? rice / 2 : -(rice / 2) - 1;
-        #else
-            byte delta = bdgr_r2d[rice];
-        #endif
-        byte v = (byte)(prediction + delta);
-        *d++ = v;
-        prediction = v;
-        bits = bdgr_k4rice[rice];
+        up = (const byte*)row;
     }
-    return w * h;
+    st->b64 = b64;
+    st->count = count;
+    for (int i = 0; i < 4; i++) { st->bits[i] = bits[i]; st->a[i] = a[i]; }
+    return p <= end ? p : null;
 }
 
-void bdgr_header(const void* input, int *w, int *h) {
-    uint64_t* p = (uint64_t*)input;
-    uint64_t b64 = 0;
-    int count = 0; // number of valid bits in b64
-    pull_bits(*w, p, b64, count, 16);
-    pull_bits(*h, p, b64, count, 16);
+static uint64_t* bdgr_encode_depth(const byte* s, int stride, const byte* above,
+        int w, int h, int n, int transform, int predictor, int depth, bdgr_state_t* st,
+        uint64_t* p, const uint64_t* end) {
+    #define bdgr_encode_samples_n(n, transform, predictor) \
+        return bdgr_encode_samples(s, stride, above, w, h, n, transform, predictor, depth, st, p, end)
+    bdgr_specialize(bdgr_encode_samples_n, n, transform, predictor);
+    #undef bdgr_encode_samples_n
+}
+
+// bdgr_encode_ex() stream header, all fields are in little endian 64 bit words:
+//   word 0:
+//     bits  0..15  0x0000 - never a width in bdgr_encode() stream of non empty image
+//     bits 16..31  w
+//     bits 32..47  h
+//     bits 48..55  predictor
+//     bits 56..63  flags
+//   word 1 (only if flags != 0):
+//     bits  0..31  rows per stripe or 0
+//     bits 32..39  channels
+//     bits 40..47  colour transform
+//     bits 48..55  bits per sample
+//     bits 56..63  Rice parameter model
+//   stripes table (only if flags & bdgr_flag_stripes):
+//     32 bit end offset of each stripe from the begining of the stream
+//     with bit 0 set for stored stripe, padded with zero to the 64 bits boundary
+// Images wider or taller than 0xFFFF pixels, streams with checksums and
+// streams coded against reference frame have versioned container header
+// instead, with all the fields always present:
+//   word 0:
+//     bits  0..31  0x00000000 - never a width in the headers above
+//     bits 32..55  bdgr_magic "BDG"
+//     bits 56..63  bdgr_version
+//   word 1:
+//     bits  0..31  w
+//     bits 32..63  h
+//   word 2:
+//     bits  0..31  rows per stripe or 0
+//     bits 32..39  predictor
+//     bits 40..47  channels
+//     bits 48..55  colour transform
+//     bits 56..63  bits per sample
+//   word 3:
+//     bits  0..7   Rice parameter model
+//     bits  8..15  flags: bdgr_flag_stripes, bdgr_flag_stored, bdgr_flag_checksum,
+//                  bdgr_flag_reference
+//     bits 16..31  0x0000 reserved
+//     bits 32..63  offset of the stripes table (or of the only stripe) in bytes
+//   stripes table (only if flags & bdgr_flag_stripes) as above
+//   checksums (only if flags & bdgr_flag_checksum):
+//     32 bit CRC32C of packed samples of each stripe, padded to 64 bits
+// Image (w * h * channels samples) is limited to 2GB by int sizes of the API.
+// Stripes are word aligned. Each one starts with bdgr_start_with_bits and
+// reset predictor: its first row is predicted from the left only.
+// Stripe that coding would not make smaller is stored: packed rows of samples
+// copied verbatim and padded with zero to the 64 bits boundary. Without
+// stripes table bdgr_flag_stored tells that the whole image is stored.
+
+enum {
+    bdgr_flag_stripes  = 0x01,
+    bdgr_flag_channels = 0x02, // more than one channel or colour transform
+    bdgr_flag_depth    = 0x04, // more than 8 bits per sample
+    bdgr_flag_stored   = 0x08, // some stripes are stored, does not need word 1
+    bdgr_flag_model    = 0x10, // Rice parameter model is not bdgr_model_last
+    bdgr_flag_checksum = 0x20, // container only: checksums follow stripes table
+    bdgr_flag_reference = 0x40 // container only: samples are differences from reference frame
+};
+
+enum {
+    bdgr_magic   = 0x474442, // "BDG" in bytes 4..6 of container header
+    bdgr_version = 1,
+    bdgr_container_bytes = 32 // without stripes table
+};
+
+static int bdgr_stripes(const bdgr_format_t* f) { // no int overflow for any h and stripe
+    return f->stripe > 0 ? (int)(((int64_t)f->h + f->stripe - 1) / f->stripe) : 1;
+}
+
+static int bdgr_channels(const bdgr_format_t* f) {
+    return f->channels > 1 ? f->channels : 1;
+}
+
+static int bdgr_depth(const bdgr_format_t* f) {
+    return f->depth > 8 ? f->depth : 8;
+}
+
+static int bdgr_sample_bytes(const bdgr_format_t* f) {
+    return bdgr_depth(f) > 8 ? 2 : 1;
+}
+
+static int bdgr_row_bytes(const bdgr_format_t* f) { // of packed samples
+    return f->w * bdgr_channels(f) * bdgr_sample_bytes(f);
+}
+
+static int bdgr_max_code(const bdgr_format_t* f) { // longest (escape) code in bits
+    return bdgr_cut_off + 1 + bdgr_depth(f);
+}
+
+static bool bdgr_container(const bdgr_format_t* f) { // needs versioned header
+    return f->w > 0xFFFF || f->h > 0xFFFF || f->checksum != 0 || f->reference != 0;
+}
+
+static int bdgr_flags(const bdgr_format_t* f) {
+    if (bdgr_container(f)) {
+        return (f->stripe > 0 ? bdgr_flag_stripes : 0) | (f->checksum ? bdgr_flag_checksum : 0) |
+               (f->reference ? bdgr_flag_reference : 0);
+    }
+    return (f->stripe > 0 ? bdgr_flag_stripes : 0) |
+           (bdgr_channels(f) > 1 || f->transform != bdgr_transform_none ? bdgr_flag_channels : 0) |
+           (bdgr_depth(f) > 8 ? bdgr_flag_depth : 0) |
+           (f->model != bdgr_model_last ? bdgr_flag_model : 0);
+}
+
+static int64_t bdgr_table_bytes(const bdgr_format_t* f) { // stripes table with padding
+    return f->stripe > 0 ? ((int64_t)bdgr_stripes(f) + 1) / 2 * 8 : 0;
+}
+
+static int64_t bdgr_checksums_bytes(const bdgr_format_t* f) { // with padding
+    return f->checksum ? ((int64_t)bdgr_stripes(f) + 1) / 2 * 8 : 0;
+}
+
+static int bdgr_header_bytes(const bdgr_format_t* f) { // bdgr_check_format() keeps it int
+    if (bdgr_container(f)) {
+        return bdgr_container_bytes + (int)(bdgr_table_bytes(f) + bdgr_checksums_bytes(f));
+    }
+    return bdgr_flags(f) == 0 ? 8 : 16 + (int)bdgr_table_bytes(f);
+}
+
+static int bdgr_stripe_rows(const bdgr_format_t* f, int i) {
+    if (f->stripe == 0) { return f->h; }
+    const int rows = f->h - i * f->stripe;
+    return rows < f->stripe ? rows : f->stripe;
+}
+
+static void bdgr_write_header(const bdgr_format_t* f, uint64_t* p) {
+    const uint64_t flags = (uint64_t)bdgr_flags(f);
+    const int stripe = f->stripe < f->h ? f->stripe : f->h; // validators expect <= h
+    if (flags & bdgr_flag_stripes) {
+        p[(bdgr_header_bytes(f) - bdgr_checksums_bytes(f)) / 8 - 1] = 0; // zero padding of odd stripes table
+    }
+    if (flags & bdgr_flag_checksum) { p[bdgr_header_bytes(f) / 8 - 1] = 0; } // and of checksums
+    if (bdgr_container(f)) {
+        p[0] = ((uint64_t)bdgr_magic << 32) | ((uint64_t)bdgr_version << 56);
+        p[1] = (uint32_t)f->w | ((uint64_t)(uint32_t)f->h << 32);
+        p[2] = (uint32_t)stripe | ((uint64_t)f->predictor << 32) |
+               ((uint64_t)bdgr_channels(f) << 40) | ((uint64_t)f->transform << 48) |
+               ((uint64_t)bdgr_depth(f) << 56);
+        p[3] = (uint64_t)f->model | (flags << 8) | ((uint64_t)bdgr_container_bytes << 32);
+        return;
+    }
+    p[0] = ((uint64_t)f->w << 16) | ((uint64_t)f->h << 32) |
+           ((uint64_t)f->predictor << 48) | (flags << 56);
+    if (flags != 0) {
+        p[1] = (uint32_t)stripe | ((uint64_t)bdgr_channels(f) << 32) |
+               ((uint64_t)f->transform << 40) | ((uint64_t)bdgr_depth(f) << 48) |
+               ((uint64_t)f->model << 56);
+    }
+}
+
+static bool bdgr_is_container(const void* stream) {
+    return (uint32_t)load64((const byte*)stream) == 0;
+}
+
+static int bdgr_table_offset(const void* stream) { // of stripes table or the only stripe
+    const byte* s = (const byte*)stream;
+    return bdgr_is_container(s) ? (int)(load64(s + 24) >> 32) : 16;
+}
+
+static uint32_t* bdgr_stripes_table(const void* stream) {
+    return (uint32_t*)((byte*)stream + bdgr_table_offset(stream));
+}
+
+static uint32_t* bdgr_checksums(const void* stream, const bdgr_format_t* f) {
+    return (uint32_t*)((byte*)stream + bdgr_table_offset(stream) + bdgr_table_bytes(f));
+}
+
+// bdgr_cache_rows() is the number of rows checksummed (or differenced with
+// reference frame) right before or after coding while they are in cache
+
+static int bdgr_cache_rows(const bdgr_format_t* f) {
+    const int rows = (16 * 1024) / bdgr_row_bytes(f);
+    return rows > 0 ? rows : 1;
+}
+
+static int bdgr_stream_flags(const void* stream) { // of either extended header
+    const byte* s = (const byte*)stream;
+    return (int)(bdgr_is_container(s) ? (load64(s + 24) >> 8) & 0xFF : load64(s) >> 56);
+}
+
+static void bdgr_set_stored(void* stream) { // whole image is stored
+    uint64_t* p = (uint64_t*)stream;
+    if (bdgr_is_container(stream)) {
+        p[3] |= (uint64_t)bdgr_flag_stored << 8;
+    } else {
+        p[0] |= (uint64_t)bdgr_flag_stored << 56;
+    }
+}
+
+static void bdgr_check_format(const bdgr_format_t* f, int stride) {
+    implore(0 < f->w && 0 < f->h && f->stripe >= 0);
+    implore(f->predictor == bdgr_predictor_left || f->predictor == bdgr_predictor_med);
+    implore(bdgr_channels(f) <= 4 && bdgr_depth(f) <= 16);
+    implore((int64_t)f->h * f->w * bdgr_channels(f) * bdgr_sample_bytes(f) <= 0x7FFFFFFF);
+    implore(bdgr_table_bytes(f) * 2 <= 0x7FFFFFFF - bdgr_container_bytes);
+    implore(f->checksum == 0 || f->checksum == 1);
+    implore(f->reference == 0 || f->reference == 1);
+    implore(stride >= bdgr_row_bytes(f));
+    implore(f->transform == bdgr_transform_none || bdgr_channels(f) >= 3);
+    implore(bdgr_model_last <= f->model && f->model <= bdgr_model_runs);
+    (void)f; (void)stride;
+}
+
+// bdgr_model_context: Rice parameter k is the smallest with codes << k >= sum
+// (JPEG-LS) kept per channel in context of local activity of the neighbours
+//   c b d
+//   a x
+// It costs a few more operations per sample than bdgr_k4rice[] lookup but
+// follows statistics of the image region instead of the last residual only.
+
+static inline int bdgr_abs(int v) { return v < 0 ? -v : v; }
+
+static inline int bdgr_context(int a, int b, int c, int d) {
+    const int g = bdgr_abs(d - b) + bdgr_abs(b - c) + bdgr_abs(c - a); // < 3 << 16
+    return 31 - (int)clz((uint32_t)g | 1); // 0 for g in [0..1], 1 for [2..3]...
+}
+
+static inline int bdgr_context_k(int sum, int codes) {
+    int k = (int)clz((uint32_t)codes) - (int)clz((uint32_t)sum | 1);
+    k = k < 0 ? 0 : k;
+    return k + ((codes << k) < sum); // clz() difference can be one short
+}
+
+static inline void bdgr_context_update(int* sum, int* codes, int rice) {
+    *sum += rice;
+    if (++*codes == bdgr_context_reset) { *sum >>= 1; *codes >>= 1; }
+}
+
+// bdgr_model_runs: when all of a, b, c, d are the same (flat context, first row
+// of a stripe excluded) the number of following pixels equal to `a` is coded
+// instead of the pixels. A run is cut at the end of the row. Blocks of
+// 1 << bdgr_run_bits[run] pixels cost one bit `1` each and widen the next
+// block; run that does not reach the end of the row is finished by bit `0` and
+// bdgr_run_bits[run] bits of the remaining length, narrows the next block and
+// is followed by regular code of the "interruption" pixel.
+
+static const byte bdgr_run_bits[32] = { // JPEG-LS J[]
+    0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3,
+    4, 4, 5, 5, 6, 6, 7, 7, 8, 9, 10, 11, 12, 13, 14, 15
+};
+
+enum { bdgr_max_run_code = 1 + 15 }; // longest run code per pixel in bits
+
+static inline bool bdgr_flat(int a, int b, int c, int d) { return a == b && b == c && c == d; }
+
+// push_run() codes run of `r` pixels, `eol` - run reaches the end of the row
+
+#define push_run(p, e, b64, count, r, eol, run) do {                          \
+    int r_ = (r);                                                             \
+    bdgr_count(runs, 1);                                                      \
+    bdgr_count(run_pixels, r_);                                               \
+    while (r_ >= (1 << bdgr_run_bits[run])) {                                 \
+        push_bits(p, e, b64, count, 1, 1);                                    \
+        r_ -= 1 << bdgr_run_bits[run];                                        \
+        if (run < 31) { run++; }                                              \
+    }                                                                         \
+    if (!(eol)) {                                                             \
+        push_bits(p, e, b64, count, (uint32_t)r_ << 1, 1 + bdgr_run_bits[run]); \
+        if (run > 0) { run--; }                                               \
+    } else if (r_ > 0) {                                                      \
+        push_bits(p, e, b64, count, 1, 1); /* partial block up to the end */  \
+    }                                                                         \
+} done
+
+// bdgr_pixel() loads n samples of the pixel x applying colour transform
+
+static inline void bdgr_pixel(const byte* s, int x, int n, bool wide, int transform,
+        int mask, int* px) {
+    for (int c = 0; c < n; c++) {
+        px[c] = wide ? ((const uint16_t*)s)[x * n + c] : s[x * n + c];
+    }
+    if (transform == bdgr_transform_rct && n >= 3) {
+        px[0] = (px[0] - px[1]) & mask;
+        px[2] = (px[2] - px[1]) & mask;
+    }
+}
+
+static inline void bdgr_pixel_inverse(const int* px, int n, bool wide, int transform,
+        int mask, byte* d, int x) {
+    int v[4];
+    for (int c = 0; c < n; c++) { v[c] = px[c]; }
+    if (transform == bdgr_transform_rct && n >= 3) {
+        v[0] = (px[0] + px[1]) & mask;
+        v[2] = (px[2] + px[1]) & mask;
+    }
+    for (int c = 0; c < n; c++) {
+        if (wide) { ((uint16_t*)d)[x * n + c] = (uint16_t)v[c]; } else { d[x * n + c] = (byte)v[c]; }
+    }
+}
+
+// neighbours() has the same definition of a, b, c, d for encoder and decoder:
+// first column has a = c = b, last column d = b, first row of the stripe
+// (no `up`) a = b = c = d = previous sample in scan order.
+
+#define neighbours(x, n, up, prev, a, b, c, d) do {                        \
+    if (up == null) {                                                           \
+        for (int i_ = 0; i_ < n; i_++) { a[i_] = b[i_] = c[i_] = d[i_] = prev[i_]; } \
+    } else {                                                                    \
+        if (x == 0) { bdgr_pixel(up, 0, n, wide, transform, mask, b); }         \
+        else { for (int i_ = 0; i_ < n; i_++) { c[i_] = b[i_]; b[i_] = d[i_]; } } \
+        if (x + 1 < w) { bdgr_pixel(up, x + 1, n, wide, transform, mask, d); }  \
+        else { for (int i_ = 0; i_ < n; i_++) { d[i_] = b[i_]; } }              \
+        for (int i_ = 0; i_ < n; i_++) {                                        \
+            if (x == 0) { c[i_] = b[i_]; }                                      \
+            a[i_] = x == 0 ? b[i_] : prev[i_];                                  \
+        }                                                                       \
+    }                                                                           \
+} done
+
+static bdgr_inline int bdgr_prediction(int predictor, const byte* up, int x,
+        int prev, int a, int b, int c) {
+    if (predictor == bdgr_predictor_left || up == null) { return prev; }
+    return x == 0 ? b : bdgr_med(a, b, c);
+}
+
+// bdgr_flat_pixel() is true when neighbours of the pixel are flat in all channels
+
+static inline bool bdgr_flat_pixel(int n, const int* a, const int* b, const int* c, const int* d) {
+    bool flat = true;
+    for (int i = 0; i < n; i++) { flat = flat && bdgr_flat(a[i], b[i], c[i], d[i]); }
+    return flat;
+}
+
+static bdgr_inline uint64_t* bdgr_encode_modeled(const byte* s, int stride, const byte* up,
+        int w, int h, int n, int transform, int predictor, bool wide, int depth, bool runs,
+        bdgr_state_t* st, uint64_t* p, const uint64_t* end) {
+    implore(1 <= n && n <= 4 && 8 <= depth && depth <= 16 && wide == (depth > 8));
+    const int mask = (1 << depth) - 1;
+    uint64_t b64 = st->b64;
+    int count = st->count;
+    int prev[4]; // previous in scan order
+    int a[4] = {0}; // left
+    int b[4] = {0}; // above
+    int c[4] = {0}; // upper-left
+    int d[4] = {0}; // upper-right
+    int px[4];
+    int run = st->run;
+    for (int i = 0; i < 4; i++) { prev[i] = st->a[i]; }
+    for (int y = 0; y < h && p <= end; y++) { // bail out on overflow
+        const byte* row = s + (size_t)y * stride;
+        for (int x = 0; x < w; x++) {
+            neighbours(x, n, up, prev, a, b, c, d);
+            if (runs && up != null && bdgr_flat_pixel(n, a, b, c, d)) {
+                int r = 0; // pixels equal to a
+                for (bool same = true; x + r < w; r++) {
+                    bdgr_pixel(row, x + r, n, wide, transform, mask, px);
+                    for (int i = 0; i < n; i++) { same = same && px[i] == a[i]; }
+                    if (!same) { break; }
+                }
+                push_run(p, end, b64, count, r, x + r == w, run);
+                for (int i = 0; i < n; i++) { prev[i] = a[i]; }
+                x += r;
+                if (x == w) { break; }
+                if (r > 0) { // neighbours() of x - 1 were skipped
+                    bdgr_pixel(up, x - 1, n, wide, transform, mask, b);
+                    bdgr_pixel(up, x, n, wide, transform, mask, d);
+                    neighbours(x, n, up, prev, a, b, c, d);
+                }
+            }
+            bdgr_pixel(row, x, n, wide, transform, mask, px);
+            for (int i = 0; i < n; i++) {
+                const int q = bdgr_context(a[i], b[i], c[i], d[i]);
+                const int k = bdgr_context_k(st->sum[i][q], st->codes[i][q]);
+                const int prediction = bdgr_prediction(predictor, up, x, prev[i], a[i], b[i], c[i]);
+                const int rice = bdgr_fold(px[i] - prediction, depth);
+                push_code(p, end, b64, count, rice, k, depth);
+                bdgr_context_update(&st->sum[i][q], &st->codes[i][q], rice);
+                prev[i] = px[i];
+            }
+        }
+        up = row;
+    }
+    st->b64 = b64;
+    st->count = count;
+    st->run = run;
+    for (int i = 0; i < 4; i++) { st->a[i] = prev[i]; }
+    return p <= end ? p : null;
+}
+
+// bdgr_encode_modeled_pixels() is bdgr_encode_modeled() for packed 8 bit pixels
+
+static inline bool bdgr_flat8(const byte* up, int x, int w, int prev) {
+    const int b = up[x];
+    const int c = x > 0 ? up[x - 1] : b;
+    const int d = x + 1 < w ? up[x + 1] : b;
+    return bdgr_flat(x > 0 ? prev : b, b, c, d);
+}
+
+static bdgr_inline uint64_t* bdgr_encode_modeled_pixels(const byte* s, const byte* up,
+        int w, int h, int predictor, bool runs, bdgr_state_t* st, uint64_t* p, const uint64_t* end) {
+    uint64_t b64 = st->b64;
+    int count = st->count;
+    int* sum = st->sum[0];
+    int* codes = st->codes[0];
+    int prev = st->a[0];
+    int run = st->run;
+    for (int y = 0; y < h && p <= end; y++) { // bail out on overflow
+        for (int x = 0; x < w; x++) {
+            if (runs && up != null && bdgr_flat8(up, x, w, prev)) {
+                const int a = x > 0 ? prev : up[0];
+                int r = 0;
+                while (x + r < w && s[x + r] == a) { r++; }
+                push_run(p, end, b64, count, r, x + r == w, run);
+                prev = a;
+                x += r;
+                if (x == w) { break; }
+            }
+            int q = 0; // first row: flat neighbourhood
+            int prediction = prev;
+            if (up != null) {
+                const int b = up[x];
+                const int c = x > 0 ? up[x - 1] : b;
+                const int d = x + 1 < w ? up[x + 1] : b;
+                const int a = x > 0 ? prev : b;
+                q = bdgr_context(a, b, c, d);
+                if (predictor == bdgr_predictor_med) { prediction = x > 0 ? bdgr_med(a, b, c) : b; }
+            }
+            const int k = bdgr_context_k(sum[q], codes[q]);
+            const int rice = delta2rice(s[x] - prediction);
+            push_code(p, end, b64, count, rice, k, 8);
+            bdgr_context_update(&sum[q], &codes[q], rice);
+            prev = s[x];
+        }
+        up = s;
+        s += w;
+    }
+    st->b64 = b64;
+    st->count = count;
+    st->run = run;
+    st->a[0] = prev;
+    return p <= end ? p : null;
+}
+
+static uint64_t* bdgr_encode_model(const byte* s, int stride, const byte* above,
+        int w, int h, int n, int transform, int predictor, int depth, bool runs,
+        bdgr_state_t* st, uint64_t* p, const uint64_t* end) {
+    if (depth == 8 && n == 1 && stride == w) {
+        #define bdgr_encode_modeled_pixels_n(predictor, runs) \
+            return bdgr_encode_modeled_pixels(s, above, w, h, predictor, runs, st, p, end)
+        if (predictor == bdgr_predictor_left) {
+            if (runs) { bdgr_encode_modeled_pixels_n(bdgr_predictor_left, true); }
+            bdgr_encode_modeled_pixels_n(bdgr_predictor_left, false);
+        }
+        if (runs) { bdgr_encode_modeled_pixels_n(bdgr_predictor_med, true); }
+        bdgr_encode_modeled_pixels_n(bdgr_predictor_med, false);
+        #undef bdgr_encode_modeled_pixels_n
+    }
+    #define bdgr_encode_modeled_n(n, transform, predictor) \
+        return bdgr_encode_modeled(s, stride, above, w, h, n, transform, predictor, \
+                                   wide_, depth, runs_, st, p, end)
+    if (depth > 8 && runs) {
+        const bool wide_ = true, runs_ = true;
+        bdgr_specialize(bdgr_encode_modeled_n, n, transform, predictor);
+    } else if (depth > 8) {
+        const bool wide_ = true, runs_ = false;
+        bdgr_specialize(bdgr_encode_modeled_n, n, transform, predictor);
+    } else if (runs) {
+        const bool wide_ = false, runs_ = true;
+        bdgr_specialize(bdgr_encode_modeled_n, n, transform, predictor);
+    } else {
+        const bool wide_ = false, runs_ = false;
+        bdgr_specialize(bdgr_encode_modeled_n, n, transform, predictor);
+    }
+    #undef bdgr_encode_modeled_n
+}
+
+// bdgr_encode_block() codes `rows` rows of a stripe with the kernel that fits the format
+
+static uint64_t* bdgr_encode_block(const bdgr_format_t* f, const byte* s, int stride,
+        const byte* above, int rows, bdgr_state_t* st, uint64_t* p, const uint64_t* end) {
+    const int n = bdgr_channels(f);
+    if (f->model != bdgr_model_last) {
+        return bdgr_encode_model(s, stride, above, f->w, rows, n, f->transform, f->predictor,
+                                 bdgr_depth(f), f->model == bdgr_model_runs, st, p, end);
+    } else if (bdgr_depth(f) > 8) {
+        return bdgr_encode_depth(s, stride, above, f->w, rows, n, f->transform, f->predictor,
+                                 bdgr_depth(f), st, p, end);
+    } else if (n == 1 && stride == f->w) {
+        return bdgr_encode_pixels(s, above, f->w, rows, f->predictor, st, p, end);
+    } else {
+        return bdgr_encode_bytes(s, stride, above, f->w, rows, n, f->transform, f->predictor,
+                                 st, p, end);
+    }
+}
+
+typedef struct bdgr_job_s { // parallel stripes job
+    const bdgr_format_t* f;
+    const byte* input;  // pixels to encode or stream to decode
+    int   bytes;        // size of the stream to decode
+    byte* output;       // stream to encode into or decoded pixels
+    int   stride;       // bytes between rows of pixels
+    int   slot;         // worst case size of the stripe in bytes
+    bdgr_atomic_t error; // of the first decoded stripe that failed
+} bdgr_job_t;
+
+// bdgr_stored_bytes() is the size of verbatim rows padded to 64 bits
+
+static int64_t bdgr_stored_bytes(const bdgr_format_t* f, int rows) {
+    return ((int64_t)rows * bdgr_row_bytes(f) + 7) / 8 * 8;
+}
+
+static void bdgr_store(const bdgr_format_t* f, const byte* s, int stride, int rows, byte* d) {
+    const int row = bdgr_row_bytes(f);
+    for (int y = 0; y < rows; y++) { memcpy(d + (size_t)y * row, s + (size_t)y * stride, row); }
+    const int64_t bytes = (int64_t)rows * row;
+    memset(d + bytes, 0, (size_t)(bdgr_stored_bytes(f, rows) - bytes));
+}
+
+// bdgr_difference() writes packed rows of (s - reference) modulo 2^depth
+// and bdgr_add_reference() turns them back into samples in place
+
+static void bdgr_difference(const bdgr_format_t* f, const byte* s, const byte* reference,
+        int stride, int rows, byte* d) {
+    const int n = bdgr_row_bytes(f) / bdgr_sample_bytes(f); // samples per row
+    const unsigned mask = (1U << bdgr_depth(f)) - 1;
+    for (int y = 0; y < rows; y++) {
+        const size_t at = (size_t)y * stride;
+        if (bdgr_depth(f) > 8) {
+            uint16_t* o = (uint16_t*)d + (size_t)y * n;
+            const uint16_t* a = (const uint16_t*)(s + at);
+            const uint16_t* b = (const uint16_t*)(reference + at);
+            for (int x = 0; x < n; x++) { o[x] = (uint16_t)((a[x] - b[x]) & mask); }
+        } else {
+            byte* o = d + (size_t)y * n;
+            for (int x = 0; x < n; x++) { o[x] = (byte)(s[at + x] - reference[at + x]); }
+        }
+    }
+}
+
+static void bdgr_add_reference(const bdgr_format_t* f, byte* d, const byte* reference,
+        int stride, int rows) {
+    const int n = bdgr_row_bytes(f) / bdgr_sample_bytes(f);
+    const unsigned mask = (1U << bdgr_depth(f)) - 1;
+    for (int y = 0; y < rows; y++) {
+        const size_t at = (size_t)y * stride;
+        if (bdgr_depth(f) > 8) {
+            uint16_t* o = (uint16_t*)(d + at);
+            const uint16_t* b = (const uint16_t*)(reference + at);
+            for (int x = 0; x < n; x++) { o[x] = (uint16_t)((o[x] + b[x]) & mask); }
+        } else {
+            for (int x = 0; x < n; x++) { d[at + x] = (byte)(d[at + x] + reference[at + x]); }
+        }
+    }
+}
+
+// bdgr_encode_stripe() returns number of bytes written, 0 on overflow
+// and has bit 0 set if the stripe is stored (bytes are multiple of 8).
+// Coding bails out as soon as it gets larger than stored rows would be.
+// With f->checksum it also sets `crc` of the stripe rows. With `reference`
+// it codes differences of chunks of rows made in `scratch` of
+// bdgr_cache_rows() + 1 rows (first one keeps last row of previous chunk).
+
+static int bdgr_encode_stripe(const bdgr_format_t* f, const byte* data, int stride, int i,
+        uint64_t* p, const uint64_t* end, uint32_t* crc, const byte* reference, byte* scratch) {
+    const size_t offset = (size_t)i * f->stripe * stride;
+    const byte* s = data + offset;
+    const int rows = bdgr_stripe_rows(f, i);
+    const int64_t stored = bdgr_stored_bytes(f, rows);
+    const uint64_t* limit = end - p > stored / 8 ? p + stored / 8 : end;
+    bdgr_state_t st;
+    bdgr_state_init(&st);
+    uint64_t* e = p;
+    if (f->checksum || reference != null) { // chunk of rows is coded while it is in cache
+        const bdgr_crc32c_t crc32c = bdgr_crc32c_fn();
+        const int row = bdgr_row_bytes(f);
+        const int chunk = bdgr_cache_rows(f);
+        uint32_t c = ~0U;
+        for (int y = 0; y < rows; y += chunk) {
+            const int k = rows - y < chunk ? rows - y : chunk;
+            const byte* r = s + (size_t)y * stride;
+            if (f->checksum) { c = bdgr_checksum(crc32c, c, r, stride, row, k); }
+            if (e != null && reference != null) {
+                byte* t = scratch + row;
+                bdgr_difference(f, r, reference + offset + (size_t)y * stride, stride, k, t);
+                e = bdgr_encode_block(f, t, row, y > 0 ? scratch : null, k, &st, e, limit);
+                memcpy(scratch, t + (size_t)(k - 1) * row, row);
+            } else if (e != null) {
+                e = bdgr_encode_block(f, r, stride, y > 0 ? r - stride : null, k, &st, e, limit);
+            }
+        }
+        if (f->checksum) { *crc = ~c; }
+    } else {
+        e = bdgr_encode_block(f, s, stride, null, rows, &st, p, limit);
+    }
+    e = bdgr_flush(&st, e, limit);
+    if (e != null) { return (int)((byte*)e - (byte*)p); }
+    if ((end - p) * 8 < stored) { return 0; }
+    bdgr_store(f, s, stride, rows, (byte*)p);
+    bdgr_count(stored, 1);
+    return (int)stored | 1;
+}
+
+static void bdgr_encode_job(void* context, int i) {
+    bdgr_job_t* job = (bdgr_job_t*)context;
+    const int at = bdgr_header_bytes(job->f) + i * job->slot;
+    uint64_t* p = (uint64_t*)(job->output + at);
+    const uint64_t* end = (uint64_t*)(job->output + at + job->slot);
+    // each stripe codes into its own worst case slot: size first, end offset later
+    bdgr_stripes_table(job->output)[i] = bdgr_encode_stripe(job->f, job->input, job->stride,
+        i, p, end, bdgr_checksums(job->output, job->f) + i, null, null);
+}
+
+int bdgr_encode(const void* data, int w, int h, void* output, int max_bytes) {
+    implore(max_bytes % 8 == 0 && max_bytes >= 0);
+    const bdgr_format_t f = { w, h, bdgr_predictor_left, 0, 1, bdgr_transform_none, 8,
+                              bdgr_model_last, 0, 0 };
+    if (bdgr_container(&f)) { return bdgr_encode_ex(data, &f, output, max_bytes); }
+    const int64_t stored = 8 + bdgr_stored_bytes(&f, h);
+    const uint64_t* end = (uint64_t*)((byte*)output + max_bytes);
+    const uint64_t* limit = max_bytes > stored ? (uint64_t*)((byte*)output + stored) : end;
+    bdgr_state_t st;
+    bdgr_state_init(&st);
+    uint64_t* p = (uint64_t*)output;
+    // shared knowledge between encoder and decoder:
+    // does not have to be encoded in the stream, may as well be simply known by both
+    push_bits(p, limit, st.b64, st.count, (uint32_t)w | ((uint32_t)h << 16), 32);
+    p = bdgr_encode_pixels((const byte*)data, null, w, h, bdgr_predictor_left, &st, p, limit);
+    p = bdgr_flush(&st, p, limit);
+    if (p != null) { return (int)((byte*)p - (byte*)output); } // in 64 bits increments
+    if (max_bytes < stored) { return 0; }
+    // does not compress: bdgr_encode_ex() stream with the whole image stored
+    bdgr_write_header(&f, (uint64_t*)output);
+    bdgr_set_stored(output);
+    bdgr_store(&f, (const byte*)data, w, h, (byte*)output + 8);
+    return (int)stored;
+}
+
+// bdgr_encode_strided() codes against `reference` (f->reference) serially
+// in `scratch` of bdgr_scratch_bytes()
+
+static int bdgr_encode_strided(const void* data, int stride, const bdgr_format_t* f,
+        void* output, int max_bytes, bdgr_parallel_for_t parallel_for, void* that,
+        const byte* reference, byte* scratch) {
+    implore(max_bytes % 8 == 0 && max_bytes >= 0);
+    bdgr_check_format(f, stride);
+    implore((reference != null) == (f->reference != 0));
+    const uint64_t* end = (uint64_t*)((byte*)output + max_bytes);
+    const int header = bdgr_header_bytes(f);
+    if (header > max_bytes) { return 0; }
+    bdgr_write_header(f, (uint64_t*)output);
+    const int n = bdgr_stripes(f);
+    if (n == 1) {
+        uint64_t* p = (uint64_t*)((byte*)output + header);
+        const int k = bdgr_encode_stripe(f, (const byte*)data, stride, 0, p, end,
+                                         bdgr_checksums(output, f), reference, scratch);
+        if (k == 0) { return 0; }
+        if (f->stripe > 0) {
+            bdgr_stripes_table(output)[0] = header + k; // keeps bit 0 of stored stripe
+        } else if (k & 1) {
+            bdgr_set_stored(output);
+        }
+        return header + (k & ~1);
+    }
+    uint32_t* table = bdgr_stripes_table(output);
+    // stripe never takes more than stored rows
+    const int64_t slot = bdgr_stored_bytes(f, f->stripe);
+    int offset = header;
+    if (parallel_for != null && reference == null && header + slot * n <= max_bytes) {
+        bdgr_job_t job = { f, (const byte*)data, 0, (byte*)output, stride, (int)slot, 0 };
+        parallel_for(that, n, bdgr_encode_job, &job);
+        for (int i = 0; i < n; i++) { // compact slots (memmove only moves down)
+            const int at = header + i * (int)slot;
+            const int k = (int)table[i];
+            swear(k != 0); // slot always fits
+            if (at != offset) { memmove((byte*)output + offset, (byte*)output + at, k & ~1); }
+            offset += k & ~1;
+            table[i] = offset | (k & 1);
+        }
+    } else {
+        for (int i = 0; i < n; i++) {
+            uint64_t* p = (uint64_t*)((byte*)output + offset);
+            const int k = bdgr_encode_stripe(f, (const byte*)data, stride, i, p, end,
+                                             bdgr_checksums(output, f) + i, reference, scratch);
+            if (k == 0) { return 0; }
+            offset += k & ~1;
+            table[i] = offset | (k & 1);
+        }
+    }
+    return offset; // in 64 bits increments
+}
+
+int bdgr_max_bytes(const bdgr_format_t* f) {
+    bdgr_format_t delta = *f; // bdgr_encode_temporal() frames of the format need container
+    delta.reference = 1;
+    int64_t bytes = bdgr_header_bytes(&delta);
+    for (int i = 0; i < bdgr_stripes(f); i++) {
+        const int64_t codes = (int64_t)bdgr_stripe_rows(f, i) * f->w * bdgr_channels(f);
+        const int64_t runs = f->model == bdgr_model_runs ? codes / bdgr_channels(f) * bdgr_max_run_code : 0;
+        bytes += (codes * bdgr_max_code(f) + runs + 63) / 64 * 8;
+    }
+    return bytes <= 0x7FFFFFF8 ? (int)bytes : 0x7FFFFFF8;
+}
+
+int bdgr_encode_parallel(const void* data, const bdgr_format_t* f, void* output, int max_bytes,
+        bdgr_parallel_for_t parallel_for, void* that) {
+    return bdgr_encode_strided(data, bdgr_row_bytes(f), f,
+                               output, max_bytes, parallel_for, that, null, null);
+}
+
+int bdgr_encode_ex(const void* data, const bdgr_format_t* f, void* output, int max_bytes) {
+    return bdgr_encode_parallel(data, f, output, max_bytes, null, null);
+}
+
+int bdgr_encode_interleaved(const void* data, int stride, const bdgr_format_t* f,
+        void* output, int max_bytes) {
+    return bdgr_encode_strided(data, stride, f, output, max_bytes, null, null, null, null);
+}
+
+int bdgr_encode_interleaved_parallel(const void* data, int stride, const bdgr_format_t* f,
+        void* output, int max_bytes, bdgr_parallel_for_t parallel_for, void* that) {
+    return bdgr_encode_strided(data, stride, f, output, max_bytes, parallel_for, that,
+                               null, null);
+}
+
+// bdgr_image_bytes() is the most bdgr_encode_strided() output can take
+// because stripes that coding does not make smaller are stored
+
+static int64_t bdgr_image_bytes(const bdgr_format_t* f) {
+    int64_t bytes = bdgr_header_bytes(f);
+    for (int i = 0; i < bdgr_stripes(f); i++) { bytes += bdgr_stored_bytes(f, bdgr_stripe_rows(f, i)); }
+    return bytes;
+}
+
+typedef struct bdgr_batch_s {
+    bdgr_image_t* images;
+    byte* arena;
+    bdgr_atomic_t error; // decode: of the first failed image
+} bdgr_batch_t;
+
+static int bdgr_encode_image(const bdgr_image_t* image, byte* output, int max_bytes) {
+    const bdgr_format_t* f = &image->format;
+    const int stride = image->stride != 0 ? image->stride : bdgr_row_bytes(f);
+    return bdgr_encode_strided(image->pixels, stride, f, output, max_bytes, null, null,
+                               null, null);
+}
+
+static void bdgr_encode_batch_job(void* context, int i) {
+    bdgr_batch_t* batch = (bdgr_batch_t*)context;
+    bdgr_image_t* image = &batch->images[i];
+    // image codes into its own worst case slot at `offset`, compacted later
+    image->bytes = bdgr_encode_image(image, batch->arena + image->offset,
+                                     (int)bdgr_image_bytes(&image->format));
+}
+
+int bdgr_encode_batch(bdgr_image_t* images, int n, void* arena, int max_bytes,
+        bdgr_parallel_for_t parallel_for, void* that) {
+    implore(max_bytes % 8 == 0 && max_bytes >= 0 && n >= 0);
+    int64_t slots = 0;
+    for (int i = 0; i < n && parallel_for != null; i++) {
+        slots += bdgr_image_bytes(&images[i].format);
+    }
+    int offset = 0;
+    if (parallel_for != null && slots <= max_bytes) {
+        int at = 0;
+        for (int i = 0; i < n; i++) {
+            images[i].offset = at;
+            at += (int)bdgr_image_bytes(&images[i].format);
+        }
+        bdgr_batch_t batch = { images, (byte*)arena, 0 };
+        parallel_for(that, n, bdgr_encode_batch_job, &batch);
+        for (int i = 0; i < n; i++) { // compact slots (memmove only moves down)
+            swear(images[i].bytes != 0); // slot always fits
+            byte* s = (byte*)arena + images[i].offset;
+            if (images[i].offset != offset) { memmove((byte*)arena + offset, s, images[i].bytes); }
+            images[i].offset = offset;
+            offset += images[i].bytes;
+        }
+    } else {
+        for (int i = 0; i < n; i++) {
+            images[i].offset = offset;
+            images[i].bytes = bdgr_encode_image(&images[i], (byte*)arena + offset, max_bytes - offset);
+            if (images[i].bytes == 0) { return 0; }
+            offset += images[i].bytes;
+        }
+    }
+    return offset;
+}
+
+void bdgr_encode_begin(bdgr_encoder_t* e, const bdgr_format_t* f, void* output, int max_bytes) {
+    implore(max_bytes % 8 == 0 && max_bytes >= 0);
+    bdgr_check_format(f, bdgr_row_bytes(f));
+    implore(!f->reference); // see bdgr_encode_temporal()
+    e->f = *f;
+    e->output = (byte*)output;
+    e->end = (byte*)output + max_bytes;
+    if (bdgr_header_bytes(f) <= max_bytes) {
+        bdgr_write_header(f, (uint64_t*)output);
+        e->p = (uint64_t*)(e->output + bdgr_header_bytes(f));
+    } else {
+        e->p = null; // does not fit, bdgr_encode_finish() will return 0
+    }
+    e->above = null;
+    e->y = 0;
+    e->crc = ~0U;
+    bdgr_state_init(&e->state);
+}
+
+void bdgr_encode_rows(bdgr_encoder_t* e, const void* rows, int stride, int n) {
+    const bdgr_format_t* f = &e->f;
+    implore(n >= 0 && e->y + n <= f->h);
+    implore(stride >= bdgr_row_bytes(f));
+    const byte* s = (const byte*)rows;
+    while (n > 0 && e->p != null) {
+        const int left = f->stripe > 0 ? f->stripe - e->y % f->stripe : f->h - e->y;
+        const int k = n < left ? n : left; // rows of the current stripe
+        if (f->checksum) { // rows are about to be coded: cache hot
+            e->crc = bdgr_checksum(bdgr_crc32c_fn(), e->crc, s, stride, bdgr_row_bytes(f), k);
+        }
+        e->p = bdgr_encode_block(f, s, stride, e->above, k, &e->state, e->p,
+                                 (const uint64_t*)e->end);
+        e->above = s + (size_t)(k - 1) * stride;
+        e->y += k;
+        s += (size_t)k * stride;
+        n -= k;
+        if (f->stripe > 0 && (k == left || e->y == f->h)) { // end of the stripe
+            e->p = bdgr_flush(&e->state, e->p, (const uint64_t*)e->end);
+            if (e->p == null) { return; }
+            const int i = (e->y - 1) / f->stripe;
+            bdgr_stripes_table(e->output)[i] = (uint32_t)((byte*)e->p - e->output);
+            if (f->checksum) { bdgr_checksums(e->output, f)[i] = ~e->crc; }
+            e->crc = ~0U;
+            bdgr_state_init(&e->state);
+            e->above = null;
+        }
+    }
+}
+
+int bdgr_encode_finish(bdgr_encoder_t* e) {
+    implore(e->y == e->f.h || e->p == null);
+    if (e->f.stripe == 0) { e->p = bdgr_flush(&e->state, e->p, (const uint64_t*)e->end); }
+    if (e->f.stripe == 0 && e->f.checksum && e->p != null) {
+        bdgr_checksums(e->output, &e->f)[0] = ~e->crc;
+    }
+    return e->p != null ? (int)((byte*)e->p - e->output) : 0; // in 64 bits increments
+}
+
+// pull_rice() decodes one code from the bottom of `b`.
+// b must hold at least bdgr_cut_off + 1 + depth valid bits. Escape has exactly
+// bdgr_cut_off zero bits before its stop bit; or-ing 1 << bdgr_cut_off in only
+// matters for corrupted streams where it keeps ctz() defined. Both branches
+// are selects - no per bit loops and no jumps.
+
+#define pull_rice(rice, b, pos, bits, depth) do {                      \
+    const int  q_ = ctz((uint32_t)(b) | (1U << bdgr_cut_off));         \
+    const bool e_ = q_ >= bdgr_cut_off; /* escape */                   \
+    const int  k_ = e_ ? (depth) : bits;                               \
+    const int  r_ = (int)((b) >> (q_ + 1)) & ((1 << k_) - 1);          \
+    rice = e_ ? r_ : (q_ << bits) | r_;                                \
+    b   >>= q_ + 1 + k_;                                               \
+    pos  += q_ + 1 + k_;                                               \
+    bdgr_count(codes, 1);                                              \
+    bdgr_count(histogram[(bits)], 1);                                  \
+    bdgr_count(escapes, e_);                                           \
+    bdgr_count(unary, e_ ? 0 : q_ + 1);                                \
+} done
+
+// Refill: unaligned 64 bit load at the byte holding bit `pos` leaves at least
+// 64 - 7 = 57 valid bits which is enough for two longest (escape) codes.
+
+#define peek64(s, pos) (load64((s) + ((pos) >> 3)) >> ((pos) & 7))
+
+// Loads past `safe` bit position would read beyond the end of the stream.
+// The last few bytes are decoded from zero padded copy in `tail` instead.
+
+static void bdgr_tail(const byte* stream, int bytes, uint64_t* at, uint64_t* pos,
+        uint64_t* safe, uint64_t tail[3]) {
+    bdgr_count(tails, 1);
+    *at += *pos >> 3; // `at` is the offset of the decoded bytes in the stream
+    *pos &= 7;
+    byte* t = (byte*)tail;
+    for (int i = 0; i < 24; i++) { t[i] = *at + i < (uint64_t)bytes ? stream[*at + i] : 0; }
+    *safe = 16 * 8; // peek64() at byte 16 reads last byte of tail[2]
+}
+
+static void bdgr_reader_init(bdgr_reader_t* r, const byte* stream, int bytes, int pos) {
+    r->stream = stream;
+    r->bytes = bytes;
+    r->tailed = 0;
+    r->stored = 0;
+    r->at = 0;
+    r->pos = (uint64_t)pos;
+    // while the 8 bytes peek64() loads are inside of the stream:
+    r->safe = ((uint64_t)bytes - 8) * 8;
+    if (bytes < 8) {
+        bdgr_tail(stream, bytes, &r->at, &r->pos, &r->safe, r->tail);
+        r->tailed = 1;
+    }
+}
+
+// Kernels keep the reader in locals that refill() uses and store it back
+// on return so the next call continues where the previous one stopped.
+
+#define reader_load(r)                                                        \
+    const byte* stream = (r)->stream;                                         \
+    const int bytes = (r)->bytes;                                             \
+    uint64_t* tail = (r)->tail;                                               \
+    const byte* s = (r)->tailed ? (const byte*)tail : stream;                 \
+    uint64_t at = (r)->at;                                                    \
+    uint64_t pos = (r)->pos;                                                  \
+    uint64_t safe = (r)->safe
+
+#define reader_store(r) do {                                                  \
+    (r)->tailed = s == (const byte*)tail;                                     \
+    (r)->at = at;                                                             \
+    (r)->pos = pos;                                                           \
+    (r)->safe = safe;                                                         \
+} done
+
+#define refill(b) do {                                                        \
+    if (pos > safe) {                                                         \
+        bdgr_tail(stream, bytes, &at, &pos, &safe, tail);                     \
+        s = (const byte*)tail;                                                \
+    }                                                                         \
+    b = peek64(s, pos);                                                       \
+} done
+
+// Valid streams never have rice >= 1 << depth. Masking keeps table lookups
+// and Rice parameter in range for malformed ones at the cost of one `and`.
+
+#define pull_delta(delta, b, bits) do {                                       \
+    int rice_;                                                                \
+    pull_rice(rice_, b, pos, bits, 8);                                        \
+    rice_ &= 0xFF;                                                            \
+    delta = rice2delta(rice_);                                                \
+    bits = bdgr_k4rice[rice_];                                                \
+} done
+
+#define pull_sample(delta, b, bits, depth) do {                               \
+    int rice_;                                                                \
+    pull_rice(rice_, b, pos, bits, depth);                                    \
+    rice_ &= (1 << (depth)) - 1;                                              \
+    delta = bdgr_unfold(rice_);                                               \
+    bits = bdgr_k4rice16(rice_);                                              \
+} done
+
+static void bdgr_decode_pixels(bdgr_reader_t* r, bdgr_state_t* st,
+        byte* d, const byte* above, int w, int h, int predictor) {
+    reader_load(r);
+    int bits = st->bits[0];
+    byte prediction = (byte)st->a[0];
+    uint64_t b;
+    byte delta;
+    if (predictor == bdgr_predictor_left) {
+        byte* end = d + (size_t)w * h;
+        while (end - d >= 2) { // two codes per refill
+            refill(b);
+            pull_delta(delta, b, bits);
+            prediction = (byte)(prediction + delta);
+            d[0] = prediction;
+            pull_delta(delta, b, bits);
+            prediction = (byte)(prediction + delta);
+            d[1] = prediction;
+            d += 2;
+        }
+        if (d < end) {
+            refill(b);
+            pull_delta(delta, b, bits);
+            prediction = (byte)(prediction + delta);
+            *d = prediction;
+        }
+    } else {
+        implore(predictor == bdgr_predictor_med);
+        if (above == null && h > 0) { // first row: left
+            for (int x = 0; x < w; x++) {
+                refill(b);
+                pull_delta(delta, b, bits);
+                prediction = (byte)(prediction + delta);
+                d[x] = prediction;
+            }
+            above = d;
+            d += w;
+            h--;
+        }
+        for (int y = 0; y < h; y++) { // the row above is already decoded output
+            refill(b);
+            pull_delta(delta, b, bits);
+            d[0] = (byte)(above[0] + delta); // first column: above
+            int x = 1;
+            while (x + 2 <= w) { // two codes per refill
+                refill(b);
+                pull_delta(delta, b, bits);
+                d[x] = (byte)(bdgr_med(d[x - 1], above[x], above[x - 1]) + delta);
+                x++;
+                pull_delta(delta, b, bits);
+                d[x] = (byte)(bdgr_med(d[x - 1], above[x], above[x - 1]) + delta);
+                x++;
+            }
+            if (x < w) {
+                refill(b);
+                pull_delta(delta, b, bits);
+                d[x] = (byte)(bdgr_med(d[x - 1], above[x], above[x - 1]) + delta);
+            }
+            above = d;
+            d += w;
+        }
+    }
+    st->bits[0] = bits;
+    st->a[0] = prediction;
+    reader_store(r);
+}
+
+static bdgr_inline void bdgr_decode_channels(bdgr_reader_t* r, bdgr_state_t* st,
+        byte* d, int stride, const byte* above, int w, int h, int n, int transform, int predictor) {
+    implore(1 <= n && n <= 4);
+    reader_load(r);
+    int  bits[4];
+    byte a[4]; // left (previous in scan order for bdgr_predictor_left)
+    byte b[4]; // above
+    byte c[4]; // upper-left
+    byte px[4];
+    uint64_t b64;
+    byte delta;
+    for (int i = 0; i < 4; i++) { bits[i] = st->bits[i]; a[i] = (byte)st->a[i]; }
+    for (int y = 0; y < h; y++) {
+        byte* row = d + (size_t)y * stride;
+        if (predictor == bdgr_predictor_left || above == null) {
+            for (int x = 0; x < w; x++) {
+                for (int i = 0; i < n; i++) {
+                    refill(b64);
+                    pull_delta(delta, b64, bits[i]);
+                    a[i] = (byte)(a[i] + delta);
+                }
+                bdgr_rct_inverse(a, n, transform, row + x * n);
+            }
+        } else {
+            implore(predictor == bdgr_predictor_med);
+            bdgr_rct(above, n, transform, b); // already decoded
+            for (int i = 0; i < n; i++) { // first column: above
+                refill(b64);
+                pull_delta(delta, b64, bits[i]);
+                px[i] = (byte)(b[i] + delta);
+                a[i] = px[i];
+                c[i] = b[i];
+            }
+            bdgr_rct_inverse(px, n, transform, row);
+            for (int x = 1; x < w; x++) {
+                bdgr_rct(above + x * n, n, transform, b);
+                for (int i = 0; i < n; i++) {
+                    refill(b64);
+                    pull_delta(delta, b64, bits[i]);
+                    px[i] = (byte)(bdgr_med(a[i], b[i], c[i]) + delta);
+                    a[i] = px[i];
+                    c[i] = b[i];
+                }
+                bdgr_rct_inverse(px, n, transform, row + x * n);
+            }
+        }
+        above = row;
+    }
+    for (int i = 0; i < 4; i++) { st->bits[i] = bits[i]; st->a[i] = a[i]; }
+    reader_store(r);
+}
+
+static void bdgr_decode_bytes(bdgr_reader_t* r, bdgr_state_t* st,
+        byte* d, int stride, const byte* above, int w, int h, int n, int transform, int predictor) {
+    #define bdgr_decode_channels_n(n, transform, predictor) do { \
+        bdgr_decode_channels(r, st, d, stride, above, w, h, n, transform, predictor); \
+        return; \
+    } done
+    bdgr_specialize(bdgr_decode_channels_n, n, transform, predictor);
+    #undef bdgr_decode_channels_n
+}
+
+static bdgr_inline void bdgr_decode_samples(bdgr_reader_t* r, bdgr_state_t* st,
+        byte* d, int stride, const byte* up, int w, int h, int n, int transform,
+        int predictor, int depth) {
+    implore(1 <= n && n <= 4 && 8 < depth && depth <= 16);
+    const int mask = (1 << depth) - 1;
+    reader_load(r);
+    int bits[4];
+    int a[4]; // left (previous in scan order for bdgr_predictor_left)
+    int b[4]; // above
+    int c[4]; // upper-left
+    int px[4];
+    uint64_t b64;
+    int delta;
+    for (int i = 0; i < 4; i++) { bits[i] = st->bits[i]; a[i] = st->a[i]; }
+    for (int y = 0; y < h; y++) {
+        uint16_t* row = (uint16_t*)(d + (size_t)y * stride);
+        if (predictor == bdgr_predictor_left || up == null) {
+            for (int x = 0; x < w; x++) {
+                for (int i = 0; i < n; i++) {
+                    refill(b64);
+                    pull_sample(delta, b64, bits[i], depth);
+                    a[i] = (a[i] + delta) & mask;
+                }
+                bdgr_rct16_inverse(a, n, transform, mask, row + x * n);
+            }
+        } else {
+            implore(predictor == bdgr_predictor_med);
+            const uint16_t* above = (const uint16_t*)up;
+            bdgr_rct16(above, n, transform, mask, b);
+            for (int i = 0; i < n; i++) { // first column: above
+                refill(b64);
+                pull_sample(delta, b64, bits[i], depth);
+                px[i] = (b[i] + delta) & mask;
+                a[i] = px[i];
+                c[i] = b[i];
+            }
+            bdgr_rct16_inverse(px, n, transform, mask, row);
+            for (int x = 1; x < w; x++) {
+                bdgr_rct16(above + x * n, n, transform, mask, b);
+                for (int i = 0; i < n; i++) {
+                    refill(b64);
+                    pull_sample(delta, b64, bits[i], depth);
+                    px[i] = (bdgr_med(a[i], b[i], c[i]) + delta) & mask;
+                    a[i] = px[i];
+                    c[i] = b[i];
+                }
+                bdgr_rct16_inverse(px, n, transform, mask, row + x * n);
+            }
+        }
+        up = (const byte*)row;
+    }
+    for (int i = 0; i < 4; i++) { st->bits[i] = bits[i]; st->a[i] = a[i]; }
+    reader_store(r);
+}
+
+static void bdgr_decode_depth(bdgr_reader_t* r, bdgr_state_t* st,
+        byte* d, int stride, const byte* above, int w, int h, int n, int transform,
+        int predictor, int depth) {
+    #define bdgr_decode_samples_n(n, transform, predictor) do { \
+        bdgr_decode_samples(r, st, d, stride, above, w, h, n, transform, predictor, depth); \
+        return; \
+    } done
+    bdgr_specialize(bdgr_decode_samples_n, n, transform, predictor);
+    #undef bdgr_decode_samples_n
+}
+
+// pull_run() decodes run of r <= `left` pixels (see push_run()), r == left
+// means that no interruption pixel follows. Lengths are clamped to `left`
+// for malformed streams.
+
+#define pull_run(r, b, left, run) do {                                        \
+    r = 0;                                                                    \
+    for (;;) {                                                                \
+        refill(b);                                                            \
+        const int m_ = 1 << bdgr_run_bits[run];                               \
+        if ((b & 1) == 0) { /* interrupted */                                 \
+            const int r_ = (int)(b >> 1) & (m_ - 1);                          \
+            r += r_ < (left) - r ? r_ : (left) - r - 1;                       \
+            b >>= 1 + bdgr_run_bits[run];                                     \
+            pos += 1 + bdgr_run_bits[run];                                    \
+            if (run > 0) { run--; }                                           \
+            break;                                                            \
+        }                                                                     \
+        b >>= 1;                                                              \
+        pos++;                                                                \
+        if (m_ <= (left) - r) {                                               \
+            r += m_;                                                          \
+            if (run < 31) { run++; }                                          \
+        } else {                                                              \
+            r = (left); /* partial block up to the end of the row */          \
+        }                                                                     \
+        if (r == (left)) { break; }                                           \
+    }                                                                         \
+    bdgr_count(runs, 1);                                                      \
+    bdgr_count(run_pixels, r);                                                \
+} done
+
+static bdgr_inline void bdgr_decode_modeled(bdgr_reader_t* r, bdgr_state_t* st,
+        byte* o, int stride, const byte* up, int w, int h, int n, int transform,
+        int predictor, bool wide, int depth, bool runs) {
+    implore(1 <= n && n <= 4 && 8 <= depth && depth <= 16 && wide == (depth > 8));
+    const int mask = (1 << depth) - 1;
+    reader_load(r);
+    int prev[4]; // previous in scan order
+    int a[4] = {0}; // left
+    int b[4] = {0}; // above
+    int c[4] = {0}; // upper-left
+    int d[4] = {0}; // upper-right
+    uint64_t b64;
+    int run = st->run;
+    for (int i = 0; i < 4; i++) { prev[i] = st->a[i]; }
+    for (int y = 0; y < h; y++) {
+        byte* row = o + (size_t)y * stride;
+        for (int x = 0; x < w; x++) {
+            neighbours(x, n, up, prev, a, b, c, d);
+            if (runs && up != null && bdgr_flat_pixel(n, a, b, c, d)) {
+                int length;
+                pull_run(length, b64, w - x, run);
+                if (n == 1 && !wide) {
+                    memset(row + x, a[0], (size_t)length);
+                } else {
+                    for (int j = 0; j < length; j++) {
+                        bdgr_pixel_inverse(a, n, wide, transform, mask, row, x + j);
+                    }
+                }
+                for (int i = 0; i < n; i++) { prev[i] = a[i]; }
+                x += length;
+                if (x == w) { break; }
+                if (length > 0) { // see bdgr_encode_modeled()
+                    bdgr_pixel(up, x - 1, n, wide, transform, mask, b);
+                    bdgr_pixel(up, x, n, wide, transform, mask, d);
+                    neighbours(x, n, up, prev, a, b, c, d);
+                }
+            }
+            for (int i = 0; i < n; i++) {
+                const int q = bdgr_context(a[i], b[i], c[i], d[i]);
+                const int k = bdgr_context_k(st->sum[i][q], st->codes[i][q]);
+                const int prediction = bdgr_prediction(predictor, up, x, prev[i], a[i], b[i], c[i]);
+                int rice;
+                refill(b64);
+                pull_rice(rice, b64, pos, k, depth);
+                rice &= mask; // see pull_delta()
+                bdgr_context_update(&st->sum[i][q], &st->codes[i][q], rice);
+                prev[i] = (prediction + bdgr_unfold(rice)) & mask;
+            }
+            bdgr_pixel_inverse(prev, n, wide, transform, mask, row, x);
+        }
+        up = row;
+    }
+    st->run = run;
+    for (int i = 0; i < 4; i++) { st->a[i] = prev[i]; }
+    reader_store(r);
+}
+
+// bdgr_decode_modeled_pixels() is bdgr_decode_modeled() for packed 8 bit pixels:
+// two codes per refill as in bdgr_decode_pixels()
+
+static bdgr_inline void bdgr_decode_modeled_pixels(bdgr_reader_t* r, bdgr_state_t* st,
+        byte* o, const byte* up, int w, int h, int predictor, bool runs) {
+    reader_load(r);
+    int* sum = st->sum[0];
+    int* codes = st->codes[0];
+    int prev = st->a[0];
+    int run = st->run;
+    uint64_t b64 = 0;
+    for (int y = 0; y < h; y++) {
+        for (int x = 0; x < w; x++) {
+            if (runs && up != null && bdgr_flat8(up, x, w, prev)) {
+                const int a = x > 0 ? prev : up[0];
+                int length;
+                pull_run(length, b64, w - x, run); // leaves >= 57 - 16 bits in b64
+                memset(o + x, a, (size_t)length);
+                prev = a;
+                x += length;
+                if (x == w) { break; }
+            }
+            int q = 0; // first row: flat neighbourhood
+            int prediction = prev;
+            if (up != null) {
+                const int b = up[x];
+                const int c = x > 0 ? up[x - 1] : b;
+                const int d = x + 1 < w ? up[x + 1] : b;
+                const int a = x > 0 ? prev : b;
+                q = bdgr_context(a, b, c, d);
+                if (predictor == bdgr_predictor_med) { prediction = x > 0 ? bdgr_med(a, b, c) : b; }
+            }
+            const int k = bdgr_context_k(sum[q], codes[q]);
+            int rice;
+            if ((x & 1) == 0) { refill(b64); } // two codes per refill
+            pull_rice(rice, b64, pos, k, 8);
+            rice &= 0xFF; // see pull_delta()
+            bdgr_context_update(&sum[q], &codes[q], rice);
+            prev = (byte)(prediction + bdgr_unfold(rice));
+            o[x] = (byte)prev;
+        }
+        up = o;
+        o += w;
+    }
+    st->run = run;
+    st->a[0] = prev;
+    reader_store(r);
+}
+
+static void bdgr_decode_model(bdgr_reader_t* r, bdgr_state_t* st,
+        byte* d, int stride, const byte* above, int w, int h, int n, int transform,
+        int predictor, int depth, bool runs) {
+    if (depth == 8 && n == 1 && stride == w) {
+        #define bdgr_decode_modeled_pixels_n(predictor, runs) do { \
+            bdgr_decode_modeled_pixels(r, st, d, above, w, h, predictor, runs); \
+            return; \
+        } done
+        if (predictor == bdgr_predictor_left) {
+            if (runs) { bdgr_decode_modeled_pixels_n(bdgr_predictor_left, true); }
+            bdgr_decode_modeled_pixels_n(bdgr_predictor_left, false);
+        }
+        if (runs) { bdgr_decode_modeled_pixels_n(bdgr_predictor_med, true); }
+        bdgr_decode_modeled_pixels_n(bdgr_predictor_med, false);
+        #undef bdgr_decode_modeled_pixels_n
+    }
+    #define bdgr_decode_modeled_n(n, transform, predictor) do { \
+        bdgr_decode_modeled(r, st, d, stride, above, w, h, n, transform, predictor, \
+                            wide_, depth, runs_); \
+        return; \
+    } done
+    if (depth > 8 && runs) {
+        const bool wide_ = true, runs_ = true;
+        bdgr_specialize(bdgr_decode_modeled_n, n, transform, predictor);
+    } else if (depth > 8) {
+        const bool wide_ = true, runs_ = false;
+        bdgr_specialize(bdgr_decode_modeled_n, n, transform, predictor);
+    } else if (runs) {
+        const bool wide_ = false, runs_ = true;
+        bdgr_specialize(bdgr_decode_modeled_n, n, transform, predictor);
+    } else {
+        const bool wide_ = false, runs_ = false;
+        bdgr_specialize(bdgr_decode_modeled_n, n, transform, predictor);
+    }
+    #undef bdgr_decode_modeled_n
+}
+
+static void bdgr_decode_block(const bdgr_format_t* f, bdgr_reader_t* r, bdgr_state_t* st,
+        byte* d, int stride, const byte* above, int rows) {
+    const int n = bdgr_channels(f);
+    if (r->stored) {
+        const int row = bdgr_row_bytes(f);
+        implore(r->at + (uint64_t)rows * row <= (uint64_t)r->bytes);
+        for (int y = 0; y < rows; y++) {
+            memcpy(d + (size_t)y * stride, r->stream + r->at, row);
+            r->at += row;
+        }
+    } else if (f->model != bdgr_model_last) {
+        bdgr_decode_model(r, st, d, stride, above, f->w, rows, n, f->transform,
+                          f->predictor, bdgr_depth(f), f->model == bdgr_model_runs);
+    } else if (bdgr_depth(f) > 8) {
+        bdgr_decode_depth(r, st, d, stride, above, f->w, rows, n, f->transform,
+                          f->predictor, bdgr_depth(f));
+    } else if (n == 1 && stride == f->w) {
+        bdgr_decode_pixels(r, st, d, above, f->w, rows, f->predictor);
+    } else {
+        bdgr_decode_bytes(r, st, d, stride, above, f->w, rows, n, f->transform,
+                          f->predictor);
+    }
+}
+
+static void bdgr_read_header(const byte* s, bdgr_format_t* f) {
+    const uint64_t b64 = load64(s);
+    if ((b64 & 0xFFFF) != 0) { // bdgr_encode() stream
+        f->w = (int)(b64 & 0xFFFF);
+        f->h = (int)((b64 >> 16) & 0xFFFF);
+        f->predictor = bdgr_predictor_left;
+        f->stripe = 0;
+        f->channels = 1;
+        f->transform = bdgr_transform_none;
+        f->depth = 8;
+        f->model = bdgr_model_last;
+        f->checksum = 0;
+        f->reference = 0;
+    } else if (bdgr_is_container(s)) {
+        const uint64_t w1 = load64(s + 8);
+        const uint64_t w2 = load64(s + 16);
+        const uint64_t w3 = load64(s + 24);
+        f->w = (int)(uint32_t)w1;
+        f->h = (int)(w1 >> 32);
+        f->stripe    = (int)(uint32_t)w2;
+        f->predictor = (int)((w2 >> 32) & 0xFF);
+        f->channels  = (int)((w2 >> 40) & 0xFF);
+        f->transform = (int)((w2 >> 48) & 0xFF);
+        f->depth     = (int)(w2 >> 56);
+        f->model     = (int)(w3 & 0xFF);
+        f->checksum  = (int)((w3 >> 8) & bdgr_flag_checksum) != 0;
+        f->reference = (int)((w3 >> 8) & bdgr_flag_reference) != 0;
+    } else {
+        f->w = (int)((b64 >> 16) & 0xFFFF);
+        f->h = (int)((b64 >> 32) & 0xFFFF);
+        f->predictor = (int)((b64 >> 48) & 0xFF);
+        const int flags = (int)(b64 >> 56);
+        const uint64_t w1 = (flags & ~bdgr_flag_stored) != 0 ? load64(s + 8) : 0;
+        f->stripe = (flags & bdgr_flag_stripes) ? (int)(uint32_t)w1 : 0;
+        f->channels  = (flags & bdgr_flag_channels) ? (int)((w1 >> 32) & 0xFF) : 1;
+        f->transform = (flags & bdgr_flag_channels) ? (int)((w1 >> 40) & 0xFF) : 0;
+        f->depth     = (flags & bdgr_flag_depth) ? (int)((w1 >> 48) & 0xFF) : 8;
+        f->model     = (flags & bdgr_flag_model) ? (int)(w1 >> 56) : bdgr_model_last;
+        f->checksum  = 0;
+        f->reference = 0;
+    }
+}
+
+// bdgr_stream_header_bytes() is where the first stripe starts: container
+// header tells the offset of its stripes table (followed by checksums)
+
+static int64_t bdgr_stream_header_bytes(const byte* s, const bdgr_format_t* f) {
+    return bdgr_is_container(s) ?
+        bdgr_table_offset(s) + bdgr_table_bytes(f) + bdgr_checksums_bytes(f) :
+        bdgr_header_bytes(f);
+}
+
+// bdgr_stripe_reader() sets reader `r` to the first code of the stripe `i`
+
+static void bdgr_stripe_reader(const byte* s, int bytes, const bdgr_format_t* f, int i,
+        bdgr_reader_t* r) {
+    int from = 0;  // stripe start in the stream
+    int to = bytes; // stripe end
+    int pos = 0;   // bit position of the first code
+    int stored = 0;
+    if ((load64(s) & 0xFFFF) != 0) { // bdgr_encode() stream: codes start at bit 32
+        pos = 32;
+    } else if (f->stripe == 0) {
+        from = (int)bdgr_stream_header_bytes(s, f);
+        stored = bdgr_stream_flags(s) & bdgr_flag_stored;
+    } else {
+        const uint32_t* table = bdgr_stripes_table(s);
+        from = i == 0 ? (int)bdgr_stream_header_bytes(s, f) : (int)(table[i - 1] & ~1U);
+        to = (int)(table[i] & ~1U);
+        stored = table[i] & 1;
+        implore(from <= to && to <= bytes);
+    }
+    bdgr_reader_init(r, s + from, to - from, pos);
+    r->stored = stored != 0;
+}
+
+// bdgr_decode_stripe() returns bdgr_error_truncated if codes ran past the end
+// of the stripe, bdgr_error_checksum if decoded rows do not match checksum.
+// Differences from `reference` are decoded into output and turned into samples
+// chunk by chunk, last row of differences of the chunk is kept in `scratch`.
+
+static int bdgr_decode_stripe(const byte* s, int bytes, const bdgr_format_t* f, int i,
+        byte* output, int stride, const byte* reference, byte* scratch) {
+    const size_t offset = (size_t)i * f->stripe * stride;
+    byte* d = output + offset;
+    const int rows = bdgr_stripe_rows(f, i);
+    bdgr_reader_t r;
+    bdgr_stripe_reader(s, bytes, f, i, &r);
+    bdgr_state_t st;
+    bdgr_state_init(&st);
+    uint32_t crc = ~0U;
+    if (r.stored) { reference = null; } // samples as is
+    if (f->checksum || reference != null) { // chunk of rows while it is in cache
+        const bdgr_crc32c_t crc32c = bdgr_crc32c_fn();
+        const int row = bdgr_row_bytes(f);
+        const int chunk = bdgr_cache_rows(f);
+        for (int y = 0; y < rows; y += chunk) {
+            const int k = rows - y < chunk ? rows - y : chunk;
+            byte* o = d + (size_t)y * stride;
+            const byte* above = y == 0 ? null : reference != null ? scratch : o - stride;
+            bdgr_decode_block(f, &r, &st, o, stride, above, k);
+            if (reference != null) {
+                memcpy(scratch, o + (size_t)(k - 1) * stride, row);
+                bdgr_add_reference(f, o, reference + offset + (size_t)y * stride, stride, k);
+            }
+            if (f->checksum) { crc = bdgr_checksum(crc32c, crc, o, stride, row, k); }
+        }
+    } else {
+        bdgr_decode_block(f, &r, &st, d, stride, null, rows);
+    }
+    // reader past the end keeps decoding zero bits from the tail
+    if (!r.stored && r.at * 8 + r.pos > (uint64_t)r.bytes * 8) { return bdgr_error_truncated; }
+    return f->checksum && ~crc != bdgr_checksums(s, f)[i] ? bdgr_error_checksum : 0;
+}
+
+static void bdgr_decode_job(void* context, int i) {
+    bdgr_job_t* job = (bdgr_job_t*)context;
+    const int e = bdgr_decode_stripe(job->input, job->bytes, job->f, i, job->output,
+                                     job->stride, null, null);
+    if (e != 0) { bdgr_atomic_cas(&job->error, 0, e); } // stripes race, first to fail wins
+}
+
+int bdgr_decode_interleaved_parallel(const void* input, int bytes, void* output, int stride,
+        bdgr_parallel_for_t parallel_for, void* that) {
+    implore(bytes % 8 == 0 && bytes >= 8);
+    bdgr_format_t f;
+    bdgr_read_header((const byte*)input, &f);
+    const int n = bdgr_stripes(&f);
+    implore(stride >= bdgr_row_bytes(&f));
+    implore(!f.reference); // see bdgr_decode_temporal()
+    bdgr_job_t job = { &f, (const byte*)input, bytes, (byte*)output, stride, 0, 0 };
+    if (parallel_for != null && n > 1) {
+        parallel_for(that, n, bdgr_decode_job, &job);
+    } else {
+        for (int i = 0; i < n; i++) { bdgr_decode_job(&job, i); }
+    }
+    const int error = (int)bdgr_atomic_load(&job.error);
+    return error != 0 ? error : bdgr_row_bytes(&f) * f.h;
+}
+
+int bdgr_decode_parallel(const void* input, int bytes, void* output, int width, int height,
+        bdgr_parallel_for_t parallel_for, void* that) {
+    implore(bytes >= 8);
+    bdgr_format_t f;
+    bdgr_read_header((const byte*)input, &f);
+    implore(f.w == width && f.h == height); (void)width; (void)height;
+    return bdgr_decode_interleaved_parallel(input, bytes, output, bdgr_row_bytes(&f), parallel_for, that);
+}
+
+int bdgr_decode_interleaved(const void* input, int bytes, void* output, int stride) {
+    return bdgr_decode_interleaved_parallel(input, bytes, output, stride, null, null);
+}
+
+int bdgr_decode(const void* input, int bytes, void* output, int width, int height) {
+    return bdgr_decode_parallel(input, bytes, output, width, height, null, null);
+}
+
+static void bdgr_decode_batch_job(void* context, int i) {
+    bdgr_batch_t* batch = (bdgr_batch_t*)context;
+    bdgr_image_t* image = &batch->images[i];
+    const byte* s = batch->arena + image->offset;
+    bdgr_format(s, &image->format);
+    const int r = bdgr_decode(s, image->bytes, image->pixels, image->format.w, image->format.h);
+    if (r < 0) { bdgr_atomic_cas(&batch->error, 0, r); } // first to fail wins
+}
+
+int bdgr_decode_batch(bdgr_image_t* images, int n, const void* arena,
+        bdgr_parallel_for_t parallel_for, void* that) {
+    implore(n >= 0);
+    bdgr_batch_t batch = { images, (byte*)arena, 0 }; // decoder does not write to arena
+    if (parallel_for != null) {
+        parallel_for(that, n, bdgr_decode_batch_job, &batch);
+    } else {
+        for (int i = 0; i < n; i++) { bdgr_decode_batch_job(&batch, i); }
+    }
+    if (bdgr_atomic_load(&batch.error) != 0) { return (int)bdgr_atomic_load(&batch.error); }
+    int64_t bytes = 0;
+    for (int i = 0; i < n; i++) {
+        bytes += (int64_t)bdgr_row_bytes(&images[i].format) * images[i].format.h;
+    }
+    return bytes <= 0x7FFFFFFF ? (int)bytes : 0x7FFFFFFF;
+}
+
+// bdgr_validate() checks everything decoder relies on except the codes
+// themselves: header fields, header size and stripes table against `bytes`.
+
+static int bdgr_validate(const byte* s, int bytes, bdgr_format_t* f) {
+    if (bytes < 8) { return bdgr_error_format; }
+    const uint64_t b64 = load64(s);
+    if ((b64 & 0xFFFF) != 0) { // bdgr_encode() stream
+        bdgr_read_header(s, f);
+        return f->h > 0 ? 0 : bdgr_error_format;
+    }
+    const bool container = bdgr_is_container(s);
+    if (container && (bytes < bdgr_container_bytes ||
+                      b64 != (((uint64_t)bdgr_magic << 32) | ((uint64_t)bdgr_version << 56)) ||
+                      (load64(s + 24) & 0xFFFF0000) != 0 || // reserved bits
+                      bdgr_table_offset(s) % 8 != 0 || bdgr_table_offset(s) < bdgr_container_bytes)) {
+        return bdgr_error_format;
+    }
+    const int flags = bdgr_stream_flags(s);
+    if (!container && (flags & ~bdgr_flag_stored) != 0 && bytes < 16) { return bdgr_error_format; }
+    bdgr_read_header(s, f);
+    const bool fields = f->w > 0 && f->h > 0 && 0 <= f->stripe && f->stripe <= f->h &&
+        (f->predictor == bdgr_predictor_left || f->predictor == bdgr_predictor_med) &&
+        1 <= f->channels && f->channels <= 4 && 8 <= f->depth && f->depth <= 16 &&
+        (f->transform == bdgr_transform_none ||
+        (f->transform == bdgr_transform_rct && f->channels >= 3)) &&
+        bdgr_model_last <= f->model && f->model <= bdgr_model_runs &&
+        (int64_t)f->h * f->w * f->channels * (f->depth > 8 ? 2 : 1) <= 0x7FFFFFFF &&
+        container == bdgr_container(f) && // only images that need it have container
+        (flags & ~bdgr_flag_stored) == bdgr_flags(f); // flags agree with the fields
+    if (!fields) { return bdgr_error_format; } // before sizes are computed from them
+    const int64_t header = bdgr_stream_header_bytes(s, f);
+    if (header > bytes) { return bdgr_error_format; }
+    const int n = bdgr_stripes(f);
+    if (f->stripe == 0) {
+        const bool stored = (flags & bdgr_flag_stored) != 0;
+        const int64_t rows = (int64_t)f->h * bdgr_row_bytes(f);
+        return !stored || header + rows <= bytes ? 0 : bdgr_error_format;
+    }
+    const uint32_t* table = bdgr_stripes_table(s);
+    int64_t from = header;
+    for (int i = 0; i < n; i++) {
+        const int64_t to = table[i] & ~1U;
+        const int64_t rows = (int64_t)bdgr_stripe_rows(f, i) * bdgr_row_bytes(f);
+        if (to < from || to > bytes || ((table[i] & 1) && to - from < rows)) {
+            return bdgr_error_format;
+        }
+        from = to;
+    }
+    return 0;
+}
+
+int bdgr_decode_checked(const void* input, int bytes, void* output, int max_bytes,
+        bdgr_format_t* format) {
+    bdgr_format_t f;
+    const int r = bdgr_validate((const byte*)input, bytes, &f);
+    if (r != 0) { return r; }
+    if (format != null) { *format = f; }
+    const int stride = bdgr_row_bytes(&f);
+    if ((int64_t)stride * f.h > max_bytes) { return bdgr_error_output; }
+    if (f.reference) { return bdgr_error_reference; }
+    int error = 0; // of the first failed stripe
+    for (int i = 0; i < bdgr_stripes(&f); i++) {
+        const int e = bdgr_decode_stripe((const byte*)input, bytes, &f, i, (byte*)output, stride,
+                                         null, null);
+        if (error == 0) { error = e; }
+    }
+    return error != 0 ? error : stride * f.h;
+}
+
+int bdgr_format_checked(const void* input, int bytes, bdgr_format_t* format) {
+    return bdgr_validate((const byte*)input, bytes, format);
+}
+
+void bdgr_decode_begin(bdgr_decoder_t* d, const void* input, int bytes, bdgr_format_t* f) {
+    implore(bytes % 8 == 0 && bytes >= 8);
+    bdgr_read_header((const byte*)input, &d->f);
+    implore(!d->f.reference); // see bdgr_decode_temporal()
+    d->input = (const byte*)input;
+    d->bytes = bytes;
+    d->above = null;
+    d->y = 0;
+    bdgr_stripe_reader(d->input, bytes, &d->f, 0, &d->reader);
+    bdgr_state_init(&d->state);
+    if (f != null) { *f = d->f; }
+}
+
+void bdgr_decode_rows(bdgr_decoder_t* d, void* rows, int stride, int n) {
+    const bdgr_format_t* f = &d->f;
+    implore(n >= 0 && d->y + n <= f->h);
+    implore(stride >= bdgr_row_bytes(f));
+    byte* o = (byte*)rows;
+    while (n > 0) {
+        const int left = f->stripe > 0 ? f->stripe - d->y % f->stripe : f->h - d->y;
+        const int k = n < left ? n : left; // rows of the current stripe
+        bdgr_decode_block(f, &d->reader, &d->state, o, stride, d->above, k);
+        d->above = o + (size_t)(k - 1) * stride;
+        d->y += k;
+        o += (size_t)k * stride;
+        n -= k;
+        if (f->stripe > 0 && k == left && d->y < f->h) { // next stripe
+            bdgr_stripe_reader(d->input, d->bytes, f, d->y / f->stripe, &d->reader);
+            bdgr_state_init(&d->state);
+            d->above = null;
+        }
+    }
+}
+
+int bdgr_decode_region(const void* input, int bytes, void* output, int stride,
+        int x, int y, int w, int h, void* scratch) {
+    implore(bytes % 8 == 0 && bytes >= 8);
+    const byte* s = (const byte*)input;
+    bdgr_format_t f;
+    bdgr_read_header(s, &f);
+    implore(!f.reference);
+    implore(0 <= x && 0 < w && x <= f.w - w && 0 <= y && 0 < h && y <= f.h - h);
+    const int row = bdgr_row_bytes(&f);
+    const int pixel = bdgr_channels(&f) * bdgr_sample_bytes(&f);
+    implore(stride >= w * pixel);
+    byte* rows[2] = { (byte*)scratch, (byte*)scratch + row };
+    const int rows_per_stripe = f.stripe > 0 ? f.stripe : f.h;
+    for (int i = y / rows_per_stripe; i * rows_per_stripe < y + h; i++) {
+        bdgr_reader_t r;
+        bdgr_stripe_reader(s, bytes, &f, i, &r);
+        bdgr_state_t st;
+        bdgr_state_init(&st);
+        const int from = i * rows_per_stripe;
+        const int rows_of_stripe = bdgr_stripe_rows(&f, i);
+        const int to = from + rows_of_stripe < y + h ? from + rows_of_stripe : y + h;
+        byte* o = (byte*)output + (size_t)(from > y ? from - y : 0) * stride;
+        if (r.stored) { // verbatim rows are random access
+            implore((uint64_t)rows_of_stripe * row <= (uint64_t)r.bytes);
+            for (int j = from > y ? from : y; j < to; j++) {
+                memcpy(o, r.stream + (size_t)(j - from) * row + (size_t)x * pixel, (size_t)w * pixel);
+                o += stride;
+            }
+            continue;
+        }
+        const byte* above = null;
+        for (int j = from; j < to; j++) {
+            byte* d = rows[j & 1];
+            bdgr_decode_block(&f, &r, &st, d, row, above, 1);
+            if (j >= y) {
+                memcpy(o, d + (size_t)x * pixel, (size_t)w * pixel);
+                o += stride;
+            }
+            above = d;
+        }
+    }
+    return w * pixel * h;
+}
+
+void bdgr_context_init(bdgr_context_t* c, const bdgr_allocator_t* allocator) {
+    implore(allocator != null && allocator->allocate != null && allocator->release != null);
+    c->allocator = *allocator;
+    c->scratch = null;
+    c->bytes = 0;
+}
+
+void bdgr_context_done(bdgr_context_t* c) {
+    if (c->scratch != null) { c->allocator.release(c->allocator.that, c->scratch, c->bytes); }
+    c->scratch = null;
+    c->bytes = 0;
+}
+
+// bdgr_scratch() returns at least `bytes` of context scratch or null
+
+static byte* bdgr_scratch(bdgr_context_t* c, size_t bytes) {
+    if (bytes > c->bytes) {
+        bdgr_context_done(c); // contents need not survive
+        c->scratch = c->allocator.allocate(c->allocator.that, bytes);
+        c->bytes = c->scratch != null ? bytes : 0;
+    }
+    return (byte*)c->scratch;
+}
+
+enum { bdgr_band_rows = 8, bdgr_band_width = 1024, bdgr_bands = 8 }; // tuning samples
+
+static size_t bdgr_scratch_bytes(const bdgr_format_t* f) { // of all calls taking context
+    // bdgr_decode_region() takes 2 rows, temporal prediction chunk and a row
+    const int rows = bdgr_cache_rows(f) + 1 > 2 ? bdgr_cache_rows(f) + 1 : 2;
+    const int64_t band = bdgr_stored_bytes(f, bdgr_band_rows); // of tuning trials (at most)
+    return (size_t)(rows * bdgr_row_bytes(f) > band ? rows * bdgr_row_bytes(f) : band);
+}
+
+int bdgr_context_reserve(bdgr_context_t* c, const bdgr_format_t* f) {
+    return bdgr_scratch(c, bdgr_scratch_bytes(f)) != null ? 0 : bdgr_error_memory;
+}
+
+int bdgr_decode_region_ex(bdgr_context_t* c, const void* input, int bytes, void* output,
+        int stride, int x, int y, int w, int h) {
+    implore(bytes >= 8);
+    bdgr_format_t f;
+    bdgr_read_header((const byte*)input, &f);
+    byte* scratch = bdgr_scratch(c, bdgr_scratch_bytes(&f));
+    if (scratch == null) { return bdgr_error_memory; }
+    return bdgr_decode_region(input, bytes, output, stride, x, y, w, h, scratch);
+}
+
+int bdgr_encode_temporal(bdgr_context_t* c, const void* input, const void* reference,
+        int stride, const bdgr_format_t* format, void* output, int max_bytes) {
+    bdgr_format_t f = *format;
+    f.reference = reference != null;
+    byte* scratch = bdgr_scratch(c, bdgr_scratch_bytes(&f));
+    if (scratch == null) { return bdgr_error_memory; }
+    return bdgr_encode_strided(input, stride, &f, output, max_bytes, null, null,
+                               (const byte*)reference, scratch);
+}
+
+int bdgr_decode_temporal(bdgr_context_t* c, const void* input, int bytes, const void* reference,
+        void* output, int stride) {
+    implore(bytes % 8 == 0 && bytes >= 8);
+    bdgr_format_t f;
+    bdgr_read_header((const byte*)input, &f);
+    implore(stride >= bdgr_row_bytes(&f));
+    if (f.reference && reference == null) { return bdgr_error_reference; }
+    byte* scratch = bdgr_scratch(c, bdgr_scratch_bytes(&f));
+    if (scratch == null) { return bdgr_error_memory; }
+    int error = 0; // of the first failed stripe
+    for (int i = 0; i < bdgr_stripes(&f); i++) {
+        const int e = bdgr_decode_stripe((const byte*)input, bytes, &f, i, (byte*)output, stride,
+                                         f.reference ? (const byte*)reference : null, scratch);
+        if (error == 0) { error = e; }
+    }
+    return error != 0 ? error : bdgr_row_bytes(&f) * f.h;
+}
+
+// bdgr_trial_bytes() is the size of the sample coded with format `f` into
+// `scratch`: bands of rows (and columns of wide images) spread over the image
+// that take about 1/8 of it. Bands that would not compress count as stored.
+
+static int64_t bdgr_trial_bytes(const bdgr_format_t* f, const byte* data, int stride,
+        byte* scratch) {
+    bdgr_format_t band = *f;
+    band.h = f->h < bdgr_band_rows ? f->h : bdgr_band_rows;
+    band.w = f->w < bdgr_band_width ? f->w : bdgr_band_width;
+    const int64_t n = (int64_t)f->w * f->h / 8 / ((int64_t)band.w * band.h);
+    const int bands = n < 1 ? 1 : n > bdgr_bands ? bdgr_bands : (int)n;
+    const int pixel = bdgr_channels(f) * bdgr_sample_bytes(f);
+    const int64_t stored = bdgr_stored_bytes(&band, band.h);
+    int64_t bytes = 0;
+    for (int i = 0; i < bands; i++) {
+        const int x = bands > 1 ? (int)((int64_t)i * (f->w - band.w) / (bands - 1)) : 0;
+        const int y = bands > 1 ? (int)((int64_t)i * (f->h - band.h) / (bands - 1)) : 0;
+        bdgr_state_t st;
+        bdgr_state_init(&st);
+        uint64_t* p = (uint64_t*)scratch;
+        const uint64_t* end = p + stored / 8;
+        const byte* s = data + (size_t)y * stride + (size_t)x * pixel;
+        uint64_t* e = bdgr_encode_block(&band, s, stride, null, band.h, &st, p, end);
+        e = bdgr_flush(&st, e, end);
+        bytes += e != null ? (byte*)e - scratch : stored;
+    }
+    return bytes;
+}
+
+int bdgr_encode_tuned(bdgr_context_t* c, const void* input, int stride,
+        const bdgr_format_t* format, int effort, void* output, int max_bytes,
+        bdgr_format_t* chosen) {
+    implore(effort == bdgr_effort_predictor || effort == bdgr_effort_model);
+    bdgr_check_format(format, stride);
+    implore(!format->reference);
+    byte* scratch = bdgr_scratch(c, bdgr_scratch_bytes(format));
+    if (scratch == null) { return bdgr_error_memory; }
+    const byte* data = (const byte*)input;
+    bdgr_format_t best = *format;
+    int64_t smallest = bdgr_trial_bytes(&best, data, stride, scratch);
+    // faster to decode first: slower candidate has to be strictly smaller
+    const int models = effort == bdgr_effort_model ? 3 : 1;
+    const int transforms = bdgr_channels(format) >= 3 ? 2 : 1;
+    for (int m = 0; m < models; m++) {
+        for (int p = bdgr_predictor_left; p <= bdgr_predictor_med; p++) {
+            for (int t = 0; t < transforms; t++) {
+                bdgr_format_t f = *format;
+                f.model = models > 1 ? (m == 0 ? bdgr_model_last : m == 1 ? bdgr_model_runs :
+                                        bdgr_model_context) : format->model;
+                f.predictor = p;
+                f.transform = transforms > 1 ? t : format->transform;
+                const int64_t bytes = bdgr_trial_bytes(&f, data, stride, scratch);
+                if (bytes < smallest) { smallest = bytes; best = f; }
+            }
+        }
+    }
+    int r = bdgr_encode_strided(input, stride, &best, output, max_bytes, null, null, null, null);
+    if (r == 0 && memcmp(&best, format, sizeof(best)) != 0) { // header of `best` does not fit
+        best = *format;
+        r = bdgr_encode_strided(input, stride, &best, output, max_bytes, null, null, null, null);
+    }
+    if (chosen != null) { *chosen = best; }
+    return r;
+}
+
+void bdgr_sequence_init(bdgr_sequence_t* q, bdgr_context_t* c, int keyframes) {
+    implore(keyframes > 0);
+    q->context = c;
+    q->keyframes = keyframes;
+    q->frame = 0;
+    q->previous = null;
+}
+
+int bdgr_encode_frame(bdgr_sequence_t* q, const void* input, int stride,
+        const bdgr_format_t* f, void* output, int max_bytes) {
+    const void* reference = q->frame % q->keyframes == 0 ? null : q->previous;
+    const int r = bdgr_encode_temporal(q->context, input, reference, stride, f, output, max_bytes);
+    q->frame = r > 0 ? (q->frame + 1) % q->keyframes : 0; // keyframe after failure
+    q->previous = input;
+    return r;
+}
+
+int bdgr_decode_frame(bdgr_sequence_t* q, const void* input, int bytes, void* output, int stride) {
+    const int r = bdgr_decode_temporal(q->context, input, bytes, q->previous, output, stride);
+    q->previous = r > 0 ? output : null;
+    return r;
+}
+
+// Progressive directory: word 0 has levels in byte 0 (bytes 1..3 are zero,
+// so it is neither compact nor container header) and magic "BDP" and version
+// in bytes 4..7, word 1 w and h of the image, word 2 channels and depth and
+// words 3..10 uint32_t ends of the layers in stream order: base, then columns
+// and rows planes of every level from the coarsest. Empty planes (of 1 pixel
+// wide or tall levels) take no bytes.
+
+enum { bdgr_progressive_magic = 0x504442, bdgr_progressive_version = 1 };
+
+enum { bdgr_plane_base, bdgr_plane_columns, bdgr_plane_rows };
+
+static void bdgr_level_format(const bdgr_format_t* f, int level, bdgr_format_t* l) {
+    *l = *f;
+    for (int i = 0; i < level; i++) { l->w = (l->w + 1) / 2; l->h = (l->h + 1) / 2; }
+}
+
+// bdgr_plane_format() is format of the plane of the level `l`: columns are
+// odd pixels of even rows, rows are odd rows
+
+static void bdgr_plane_format(const bdgr_format_t* l, int plane, bdgr_format_t* p) {
+    *p = *l;
+    p->w = plane == bdgr_plane_columns ? l->w / 2 : l->w;
+    p->h = plane == bdgr_plane_columns ? (l->h + 1) / 2 : plane == bdgr_plane_rows ? l->h / 2 : l->h;
+    p->reference = plane != bdgr_plane_base;
+}
+
+// bdgr_layer() is the layer of stream order `i` (of 1 + 2 * levels): base of
+// level `levels` or plane of level `levels - 1 - (i - 1) / 2`
+
+static int bdgr_layer(const bdgr_format_t* f, int levels, int i, bdgr_format_t* p) {
+    const int level = i == 0 ? levels : levels - 1 - (i - 1) / 2;
+    const int plane = i == 0 ? bdgr_plane_base : (i - 1) % 2 == 0 ? bdgr_plane_columns : bdgr_plane_rows;
+    bdgr_format_t l;
+    bdgr_level_format(f, level, &l);
+    bdgr_plane_format(&l, plane, p);
+    return level;
+}
+
+// bdgr_lattice() moves packed rows of the plane `p` (unless it is null) of
+// level `l` from or to the image where pixel (x, y) of the level is pixel
+// (x * step, y * step) of rows `stride` apart. With `reference` it writes
+// averages of the known neighbours of the plane pixels in the image: left and
+// right for columns, above and below for rows (the missing last one is the
+// other one).
+
+static void bdgr_lattice(const bdgr_format_t* l, int plane, byte* image, int stride, int step,
+        byte* p, bool scatter, byte* reference) {
+    bdgr_format_t f;
+    bdgr_plane_format(l, plane, &f);
+    const int n = bdgr_channels(l);
+    const int bytes = bdgr_sample_bytes(l);
+    const int pixel = n * bytes;
+    const size_t dx = (size_t)step * pixel;
+    const size_t dy = (size_t)step * stride;
+    for (int j = 0; j < f.h; j++) {
+        const int y = plane == bdgr_plane_columns ? j * 2 : plane == bdgr_plane_rows ? j * 2 + 1 : j;
+        for (int i = 0; i < f.w; i++) {
+            const int x = plane == bdgr_plane_columns ? i * 2 + 1 : i;
+            byte* s = image + y * dy + x * dx;
+            if (p != null) {
+                byte* d = p + ((size_t)j * f.w + i) * pixel;
+                if (scatter) { memcpy(s, d, pixel); } else { memcpy(d, s, pixel); }
+            }
+            if (reference != null) {
+                const byte* a = plane == bdgr_plane_columns ? s - dx : s - dy;
+                const byte* b = plane == bdgr_plane_columns ? (x + 1 < l->w ? s + dx : a) :
+                                                              (y + 1 < l->h ? s + dy : a);
+                byte* r = reference + ((size_t)j * f.w + i) * pixel;
+                for (int c = 0; c < n; c++) {
+                    if (bytes == 2) {
+                        ((uint16_t*)r)[c] = (uint16_t)((((const uint16_t*)a)[c] +
+                                                        ((const uint16_t*)b)[c] + 1) >> 1);
+                    } else {
+                        r[c] = (byte)((a[c] + b[c] + 1) >> 1);
+                    }
+                }
+            }
+        }
+    }
+}
+
+// bdgr_progressive_directory() validates directory and reads format of the
+// full image, returns number of levels or error
+
+static int bdgr_progressive_directory(const byte* s, int bytes, bdgr_format_t* f) {
+    if (bytes < bdgr_progressive_header) { return bdgr_error_truncated; }
+    const uint64_t w0 = load64(s);
+    const uint64_t w1 = load64(s + 8);
+    const uint64_t w2 = load64(s + 16);
+    const int levels = (int)(w0 & 0xFF);
+    memset(f, 0, sizeof(*f));
+    f->w = (int)(uint32_t)w1;
+    f->h = (int)(w1 >> 32);
+    f->channels = (int)(w2 & 0xFF);
+    f->depth = (int)((w2 >> 8) & 0xFF);
+    bool valid = (w0 >> 8) == (((uint64_t)bdgr_progressive_magic << 24) |
+                               ((uint64_t)bdgr_progressive_version << 48)) &&
+        1 <= levels && levels <= bdgr_progressive_levels && (w2 >> 16) == 0 &&
+        f->w > 0 && f->h > 0 && 1 <= f->channels && f->channels <= 4 &&
+        8 <= f->depth && f->depth <= 16 &&
+        (int64_t)f->h * f->w * f->channels * (f->depth > 8 ? 2 : 1) <= 0x7FFFFFFF;
+    const uint32_t* ends = (const uint32_t*)(s + 24);
+    uint32_t from = bdgr_progressive_header;
+    for (int i = 0; i < (bdgr_progressive_header - 24) / 4 && valid; i++) {
+        bdgr_format_t p;
+        if (i <= 2 * levels) { bdgr_layer(f, levels, i, &p); } else { p.w = 0; p.h = 0; }
+        valid = i > 2 * levels ? ends[i] == 0 : p.w == 0 || p.h == 0 ? ends[i] == from :
+                ends[i] > from && ends[i] % 8 == 0 && ends[i] <= 0x7FFFFFF8;
+        from = ends[i];
+    }
+    return valid ? levels : bdgr_error_format;
+}
+
+int bdgr_progressive_max_bytes(const bdgr_format_t* format, int levels) {
+    implore(1 <= levels && levels <= bdgr_progressive_levels);
+    int64_t bytes = bdgr_progressive_header;
+    for (int i = 0; i <= 2 * levels; i++) {
+        bdgr_format_t p;
+        bdgr_layer(format, levels, i, &p);
+        if (p.w > 0 && p.h > 0) { bytes += bdgr_max_bytes(&p); }
+    }
+    return bytes <= 0x7FFFFFF8 ? (int)bytes : 0x7FFFFFF8;
+}
+
+// bdgr_progressive_scratch() lays out context scratch: coding rows of the
+// largest layer of the first `layers` ones, then its plane and its reference
+
+static byte* bdgr_progressive_scratch(bdgr_context_t* c, const bdgr_format_t* f, int levels,
+        int layers, byte** plane, byte** reference) {
+    size_t work = 0;
+    size_t bytes = 0;
+    for (int i = 0; i < layers; i++) {
+        bdgr_format_t p;
+        bdgr_layer(f, levels, i, &p);
+        if (p.w == 0 || p.h == 0) { continue; }
+        const size_t size = ((size_t)bdgr_row_bytes(&p) * p.h + 7) / 8 * 8;
+        work  = bdgr_scratch_bytes(&p) > work ? bdgr_scratch_bytes(&p) : work;
+        bytes = size > bytes ? size : bytes;
+    }
+    work = (work + 7) / 8 * 8;
+    byte* scratch = bdgr_scratch(c, work + bytes * 2);
+    *plane = scratch + work;
+    *reference = scratch + work + bytes;
+    return scratch;
+}
+
+int bdgr_encode_progressive(bdgr_context_t* c, const void* input, int stride,
+        const bdgr_format_t* format, int levels, void* output, int max_bytes) {
+    bdgr_check_format(format, stride);
+    implore(!format->reference && 1 <= levels && levels <= bdgr_progressive_levels);
+    implore(max_bytes % 8 == 0 && max_bytes >= 0);
+    byte* plane = null;
+    byte* reference = null;
+    byte* scratch = bdgr_progressive_scratch(c, format, levels, 1 + 2 * levels, &plane, &reference);
+    if (scratch == null) { return bdgr_error_memory; }
+    if (max_bytes < bdgr_progressive_header) { return 0; }
+    uint64_t* d = (uint64_t*)output;
+    memset(d, 0, bdgr_progressive_header);
+    d[0] = (uint64_t)levels | ((uint64_t)bdgr_progressive_magic << 32) |
+           ((uint64_t)bdgr_progressive_version << 56);
+    d[1] = (uint32_t)format->w | ((uint64_t)(uint32_t)format->h << 32);
+    d[2] = (uint64_t)bdgr_channels(format) | ((uint64_t)bdgr_depth(format) << 8);
+    uint32_t* ends = (uint32_t*)(d + 3);
+    int offset = bdgr_progressive_header;
+    for (int i = 0; i <= 2 * levels; i++) {
+        bdgr_format_t p;
+        const int level = bdgr_layer(format, levels, i, &p);
+        if (p.w > 0 && p.h > 0) {
+            bdgr_format_t l;
+            bdgr_level_format(format, level, &l);
+            bdgr_lattice(&l, i == 0 ? bdgr_plane_base : 1 + (i - 1) % 2, (byte*)input, stride,
+                         1 << level, plane, false, i > 0 ? reference : null);
+            const int k = bdgr_encode_strided(plane, bdgr_row_bytes(&p), &p, (byte*)output + offset,
+                                              max_bytes - offset, null, null,
+                                              i > 0 ? reference : null, scratch);
+            if (k == 0) { return 0; }
+            offset += k;
+        }
+        ends[i] = (uint32_t)offset;
+    }
+    return offset;
+}
+
+int bdgr_progressive_bytes(const void* input, int bytes, int level, bdgr_format_t* format) {
+    implore(level >= 0);
+    bdgr_format_t f;
+    const int levels = bdgr_progressive_directory((const byte*)input, bytes, &f);
+    if (levels < 0) { return levels; }
+    level = level < levels ? level : levels;
+    if (format != null) { bdgr_level_format(&f, level, format); }
+    return (int)((const uint32_t*)((const byte*)input + 24))[2 * (levels - level)];
+}
+
+int bdgr_decode_progressive(bdgr_context_t* c, const void* input, int bytes, int level,
+        void* output, int stride) {
+    implore(level >= 0);
+    const byte* s = (const byte*)input;
+    bdgr_format_t image;
+    const int levels = bdgr_progressive_directory(s, bytes, &image);
+    if (levels < 0) { return levels; }
+    level = level < levels ? level : levels;
+    const int layers = 1 + 2 * (levels - level);
+    const uint32_t* ends = (const uint32_t*)(s + 24);
+    if ((int64_t)ends[layers - 1] > bytes) { return bdgr_error_truncated; }
+    for (int i = 0; i < layers; i++) { // validate layers before decoding any
+        const int from = i == 0 ? bdgr_progressive_header : (int)ends[i - 1];
+        bdgr_format_t p;
+        bdgr_format_t f;
+        bdgr_layer(&image, levels, i, &p);
+        if (p.w > 0 && p.h > 0 &&
+            (bdgr_validate(s + from, (int)ends[i] - from, &f) != 0 || f.w != p.w || f.h != p.h ||
+             f.channels != image.channels || f.depth != image.depth || f.reference != (i > 0))) {
+            return bdgr_error_format;
+        }
+    }
+    bdgr_format_t top;
+    bdgr_level_format(&image, level, &top);
+    implore(stride >= bdgr_row_bytes(&top));
+    byte* plane = null;
+    byte* reference = null;
+    byte* scratch = bdgr_progressive_scratch(c, &image, levels, layers, &plane, &reference);
+    if (scratch == null) { return bdgr_error_memory; }
+    int error = 0; // of the first failed stripe
+    for (int i = 0; i < layers; i++) {
+        const int from = i == 0 ? bdgr_progressive_header : (int)ends[i - 1];
+        bdgr_format_t p;
+        const int l = bdgr_layer(&image, levels, i, &p);
+        if (p.w == 0 || p.h == 0) { continue; }
+        bdgr_format_t f;
+        bdgr_read_header(s + from, &f); // validated: the same as `p` but for coding fields
+        bdgr_format_t lf;
+        bdgr_level_format(&image, l, &lf);
+        const int kind = i == 0 ? bdgr_plane_base : 1 + (i - 1) % 2;
+        if (i > 0) { // reference from pixels of the layers decoded so far
+            bdgr_lattice(&lf, kind, (byte*)output, stride, 1 << (l - level), null, false, reference);
+        }
+        for (int k = 0; k < bdgr_stripes(&f); k++) {
+            const int e = bdgr_decode_stripe(s + from, (int)ends[i] - from, &f, k, plane,
+                                             bdgr_row_bytes(&f), i > 0 ? reference : null, scratch);
+            if (error == 0) { error = e; }
+        }
+        bdgr_lattice(&lf, kind, (byte*)output, stride, 1 << (l - level), plane, true, null);
+    }
+    return error != 0 ? error : bdgr_row_bytes(&top) * top.h;
+}
+
+void bdgr_header(const void* input, int *w, int *h) {
+    bdgr_format_t f;
+    bdgr_read_header((const byte*)input, &f);
+    *w = f.w;
+    *h = f.h;
+}
+
+void bdgr_format(const void* input, bdgr_format_t* f) {
+    bdgr_read_header((const byte*)input, f);
 }
 
 #pragma pop_macro("implore")
 #pragma pop_macro("swear")
 #pragma pop_macro("ctz")
+#pragma pop_macro("clz")
 #pragma pop_macro("byte")
+#pragma pop_macro("null")
 #pragma pop_macro("done")
-#pragma pop_macro("push_out")
-#pragma pop_macro("push_bit_0")
-#pragma pop_macro("push_bit_1")
 #pragma pop_macro("push_bits")
-#pragma pop_macro("pull_in")
-#pragma pop_macro("pull_bits")
+#pragma pop_macro("pull_rice")
+#pragma pop_macro("rice2delta")
+#pragma pop_macro("pull_delta")
+#pragma pop_macro("refill")
+#pragma pop_macro("push_code")
+#pragma pop_macro("neighbours")
+#pragma pop_macro("push_run")
+#pragma pop_macro("pull_run")
+#pragma pop_macro("bdgr_specialize")
+#pragma pop_macro("bdgr_specialize_n")
+#pragma pop_macro("bdgr_sse2")
+#pragma pop_macro("bdgr_neon")
+#pragma pop_macro("bdgr_avx2_target")
+#pragma pop_macro("bdgr_sse42_target")
+#pragma pop_macro("bdgr_count")
+#pragma pop_macro("bdgr_thread_local")
+#pragma pop_macro("push_pixel")
+#pragma pop_macro("push_sample")
+#pragma pop_macro("pull_sample")
+#pragma pop_macro("delta2rice")
+#pragma pop_macro("peek64")
+#pragma pop_macro("load64")
+#pragma pop_macro("reader_load")
+#pragma pop_macro("reader_store")
 
 #endif // BDGR_IMPLEMENTATION
 